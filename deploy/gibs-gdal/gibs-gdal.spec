@@ -3,6 +3,11 @@
 %global mrf_version 0.6.1
 %global mrf_release 1%{?dist}
 
+# Optional MRF codecs
+%bcond_without zstd
+%bcond_without lz4
+%bcond_with libdeflate
+
 Name:		gibs-gdal
 Version:	%{gdal_version}
 Release:	%{gdal_release}
@@ -39,6 +44,18 @@ BuildRequires:	doxygen
 BuildRequires:	expat-devel
 BuildRequires:  python-setuptools
 Requires:	proj-devel
+%if %{with zstd}
+BuildRequires:	libzstd-devel
+Requires:	libzstd
+%endif
+%if %{with lz4}
+BuildRequires:	lz4-devel
+Requires:	lz4
+%endif
+%if %{with libdeflate}
+BuildRequires:	libdeflate-devel
+Requires:	libdeflate
+%endif
 
 Provides:	gdal = %{gdal_version}-%{gdal_release}
 Obsoletes:	gdal < 1.10
@@ -79,9 +96,9 @@ cp %{SOURCE1} upstream
 
 %build
 %if 0%{?el6}
-make gdal PREFIX=/usr POSTGRES_VERSION=9.2
+make gdal PREFIX=/usr POSTGRES_VERSION=9.2 %{?with_zstd:ZSTD_LIB=-lzstd} %{?with_lz4:LZ4_LIB=-llz4} %{?with_libdeflate:LIBDEFLATE_LIB=-ldeflate}
 %else
-make gdal PREFIX=/usr POSTGRES_VERSION=9.3
+make gdal PREFIX=/usr POSTGRES_VERSION=9.3 %{?with_zstd:ZSTD_LIB=-lzstd} %{?with_lz4:LZ4_LIB=-llz4} %{?with_libdeflate:LIBDEFLATE_LIB=-ldeflate}
 %endif
 
 
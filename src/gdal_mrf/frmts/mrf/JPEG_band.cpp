@@ -45,7 +45,7 @@ CPL_C_END
 
 struct ErrorMgr: public jpeg_error_mgr {
     inline ErrorMgr();
-    int signaled() { return setjmp(setjmpBuffer); };
+    // setjmp has to be called directly in the function calling libjpeg
     jmp_buf setjmpBuffer;
 };
 
@@ -114,71 +114,132 @@ static boolean empty_output_buffer(j_compress_ptr cinfo) {
     return FALSE;
 }
 
-/*
- *\Brief Compress a JPEG page
- * 
- * For now it only handles byte data, grayscale, RGB or CMYK
- *
- * Returns the compressed size in dest.size
+/**
+ *\brief A compressor, set up once with the page parameters and the quantization tables
+ */
+struct JPEGCompressor {
+    JPEGCompressor() : created(false) {}
+    bool created;	// Set once jpeg_create_compress returns
+    jpeg_compress_struct cinfo;
+    ErrorMgr jerr;
+    jpeg_destination_mgr jmgr;
+    std::vector<JSAMPROW> rowp;
+};
+
+/**
+ *\brief A decompressor, created once
  */
+struct JPEGDecompressor {
+    JPEGDecompressor() : created(false) {}
+    bool created;	// Set once jpeg_create_decompress returns
+    jpeg_decompress_struct cinfo;
+    ErrorMgr jerr;
+    jpeg_source_mgr src;
+};
 
-CPLErr CompressJPEG(buf_mgr &dst, buf_mgr &src, const ILImage &img) 
+// The create can fail through error_exit, in which case there is nothing to destroy
+static void DeleteCompressor(JPEGCompressor *c)
+{
+    if (c->created)
+	jpeg_destroy_compress(&c->cinfo);
+    delete c;
+}
 
+static void DeleteDecompressor(JPEGDecompressor *d)
 {
-    // The cinfo should stay open and reside in the DS, since it can be left initialized
-    // It saves some time because it has the tables initialized
-    struct jpeg_compress_struct cinfo;
-    ErrorMgr jerr;
+    if (d->created)
+	jpeg_destroy_decompress(&d->cinfo);
+    delete d;
+}
 
-    jpeg_destination_mgr jmgr;
-    jmgr.next_output_byte = (JOCTET *)dst.buffer;
-    jmgr.free_in_buffer = dst.size;
-    jmgr.init_destination = init_or_terminate_destination;
-    jmgr.empty_output_buffer = empty_output_buffer;
-    jmgr.term_destination = init_or_terminate_destination;
+static JPEGCompressor *NewCompressor(const ILImage &img)
+{
+    JPEGCompressor *c = new JPEGCompressor;
+    // The error manager has to be set before the create
+    c->cinfo.err = &c->jerr;
+    if (setjmp(c->jerr.setjmpBuffer)) {
+	DeleteCompressor(c);
+	return NULL;
+    }
 
-    // Look at the source of this, some interesting tidbits
-    jpeg_create_compress(&cinfo);
-    cinfo.dest=&jmgr;
-    cinfo.err=&jerr;
+    jpeg_create_compress(&c->cinfo);
+    c->created = true;
+    c->jmgr.init_destination = init_or_terminate_destination;
+    c->jmgr.empty_output_buffer = empty_output_buffer;
+    c->jmgr.term_destination = init_or_terminate_destination;
+    c->cinfo.dest = &c->jmgr;
 
     // The page specific info, size and color spaces
-    cinfo.image_width = img.pagesize.x;
-    cinfo.image_height = img.pagesize.y;
-    cinfo.input_components = img.pagesize.c;
-    switch (cinfo.input_components) {
-    case 1:cinfo.in_color_space=JCS_GRAYSCALE; break;
-    case 4:cinfo.in_color_space=JCS_CMYK; break;
-    default:cinfo.in_color_space=JCS_RGB;
+    c->cinfo.image_width = img.pagesize.x;
+    c->cinfo.image_height = img.pagesize.y;
+    c->cinfo.input_components = img.pagesize.c;
+    switch (c->cinfo.input_components) {
+    case 1:c->cinfo.in_color_space=JCS_GRAYSCALE; break;
+    case 4:c->cinfo.in_color_space=JCS_CMYK; break;
+    default:c->cinfo.in_color_space=JCS_RGB;
     }
 
     // Set all required fields and overwrite the ones we want to change
-    jpeg_set_defaults(&cinfo);
+    jpeg_set_defaults(&c->cinfo);
+
+    jpeg_set_quality(&c->cinfo, img.quality, TRUE);
+    c->cinfo.dct_method=JDCT_FLOAT;
+    c->rowp.resize(img.pagesize.y);
+    return c;
+}
+
+static JPEGDecompressor *NewDecompressor()
+{
+    JPEGDecompressor *d = new JPEGDecompressor;
+    d->cinfo.err = &d->jerr;
+    if (setjmp(d->jerr.setjmpBuffer)) {
+	DeleteDecompressor(d);
+	return NULL;
+    }
+
+    jpeg_create_decompress(&d->cinfo);
+    d->created = true;
+    d->src.term_source = d->src.init_source = stub_source_dec;
+    d->src.skip_input_data = skip_input_data_dec;
+    d->src.fill_input_buffer = fill_input_buffer_dec;
+    d->src.resync_to_restart = jpeg_resync_to_restart;
+    return d;
+}
 
-    jpeg_set_quality(&cinfo, img.quality, TRUE);
-    cinfo.dct_method=JDCT_FLOAT;
+/*
+ *\Brief Compress a JPEG page
+ * 
+ * For now it only handles byte data, grayscale, RGB or CMYK
+ * The compressor is left in the idle state, ready for the next page, or deleted on error
+ *
+ * Returns the compressed size in dest.size
+ */
+
+static CPLErr CompressJPEG(JPEGCompressor *c, buf_mgr &dst, buf_mgr &src, const ILImage &img)
+
+{
+    jpeg_compress_struct &cinfo = c->cinfo;
+    c->jmgr.next_output_byte = (JOCTET *)dst.buffer;
+    c->jmgr.free_in_buffer = dst.size;
+    c->jerr.num_warnings = 0;
 
     int linesize=cinfo.image_width*cinfo.num_components*((cinfo.data_precision==8)?1:2);
-    JSAMPROW *rowp=(JSAMPROW *)CPLMalloc(sizeof(JSAMPROW)*img.pagesize.y);
     for (int i=0;i<img.pagesize.y;i++)
-        rowp[i]=(JSAMPROW)(src.buffer+i*linesize);
+        c->rowp[i]=(JSAMPROW)(src.buffer+i*linesize);
 
-    if (jerr.signaled()) {
+    if (setjmp(c->jerr.setjmpBuffer)) {
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: JPEG compression error");
-        jpeg_destroy_compress(&cinfo);
-        CPLFree(rowp);
+        DeleteCompressor(c);
         return CE_Failure;
     }
     
+    // Tables are written in every page, they are not recomputed
     jpeg_start_compress(&cinfo,TRUE);
-    jpeg_write_scanlines(&cinfo,rowp,img.pagesize.y);
+    jpeg_write_scanlines(&cinfo,&c->rowp[0],img.pagesize.y);
     jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-
-    CPLFree(rowp);
 
     // Figure out the size
-    dst.size-=jmgr.free_in_buffer;
+    dst.size-=c->jmgr.free_in_buffer;
 
     return CE_None;
 }
@@ -186,53 +247,50 @@ CPLErr CompressJPEG(buf_mgr &dst, buf_mgr &src, const ILImage &img)
 /**
  *\brief In memory decompression of JPEG file
  *
- * @param data pointer to output buffer 
- * @param png pointer to PNG in memory
- * @param sz if non-zero, test that uncompressed data fits in the buffer.
+ * The decompressor is left in the idle state, ready for the next page, or deleted on error
+ * @param dst output buffer, has to be large enough for the whole page
+ * @param isrc the JPEG stream in memory
+ * @param nbands number of bands expected
+ * @param scale 1, 2, 4 or 8, the page is decoded at 1/scale of the size, in the DCT domain
  */
 
-CPLErr DecompressJPEG(buf_mgr &dst, buf_mgr &isrc, int nbands) 
+static CPLErr DecompressJPEG(JPEGDecompressor *d, buf_mgr &dst, buf_mgr &isrc, int nbands, int scale)
 
 {
-    // Locals, clean up after themselves
-    jpeg_decompress_struct cinfo={0};
-    ErrorMgr jerr;
-
-    struct jpeg_source_mgr src={(JOCTET *)isrc.buffer, isrc.size};
-
-    cinfo.err=&jerr;
-    src.term_source = src.init_source = stub_source_dec;
-    src.skip_input_data = skip_input_data_dec;
-    src.fill_input_buffer = fill_input_buffer_dec;
-    src.resync_to_restart = jpeg_resync_to_restart;
+    jpeg_decompress_struct &cinfo = d->cinfo;
+    d->src.next_input_byte = (JOCTET *)isrc.buffer;
+    d->src.bytes_in_buffer = isrc.size;
+    d->jerr.num_warnings = 0;
 
-    if (jerr.signaled()) {
+    if (setjmp(d->jerr.setjmpBuffer)) {
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error reading JPEG page");
+        DeleteDecompressor(d);
         return CE_Failure;
     }
-    jpeg_create_decompress(&cinfo);
-    cinfo.src = &src;
+    cinfo.src = &d->src;
     jpeg_read_header(&cinfo, TRUE);
     // Use float, it is actually faster than the ISLOW method by a tiny bit
     cinfo.dct_method = JDCT_FLOAT;
     if (nbands == 3 && cinfo.num_components != nbands)
 	cinfo.out_color_space = JCS_RGB;
-    int linesize = cinfo.image_width * nbands * ((cinfo.data_precision==8)?1:2);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
 
     jpeg_start_decompress(&cinfo);
+    int linesize = cinfo.output_width * nbands * ((cinfo.data_precision==8)?1:2);
 
     // We have a missmatch between the real and the declared data format
     // warn and fail if output buffer is too small
-    if (linesize*cinfo.image_height!=dst.size) {
+    if (linesize*cinfo.output_height!=dst.size) {
         CPLError(CE_Warning,CPLE_AppDefined,"MRF: read JPEG size is wrong");
-        if (linesize*cinfo.image_height>dst.size) {
+        if (linesize*cinfo.output_height>dst.size) {
             CPLError(CE_Failure,CPLE_AppDefined,"MRF: JPEG decompress buffer overflow");
-            jpeg_destroy_decompress(&cinfo);
+            DeleteDecompressor(d);
             return CE_Failure;
         }
     }
     // Decompress, two lines at a time
-    while (cinfo.output_scanline < cinfo.image_height ) {
+    while (cinfo.output_scanline < cinfo.output_height ) {
         char *rp[2];
         rp[0]=(char *)dst.buffer+linesize*cinfo.output_scanline;
         rp[1]=rp[0]+linesize;
@@ -241,17 +299,45 @@ CPLErr DecompressJPEG(buf_mgr &dst, buf_mgr &isrc, int nbands)
         jpeg_read_scanlines(&cinfo,JSAMPARRAY(rp),2);
     }
     jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
     return CE_None;
 }
 
+JPEG_Band::~JPEG_Band()
+{
+    for (size_t i = 0; i < cpool.size(); i++)
+	DeleteCompressor((JPEGCompressor *)cpool[i]);
+    for (size_t i = 0; i < dpool.size(); i++)
+	DeleteDecompressor((JPEGDecompressor *)dpool[i]);
+}
+
 CPLErr JPEG_Band::Decompress(buf_mgr &dst, buf_mgr &src) 
 { 
-    return DecompressJPEG(dst, src, img.pagesize.c); 
+    return DecompressScaled(dst, src, 1);
+}
+
+// Decode a page at 1/scale of the size, scale can be 1, 2, 4 or 8
+CPLErr JPEG_Band::DecompressScaled(buf_mgr &dst, buf_mgr &src, int scale)
+{
+    JPEGDecompressor *d = (JPEGDecompressor *)GetCodec(dpool);
+    if (NULL == d && NULL == (d = NewDecompressor())) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: Can't initialize JPEG decompressor");
+	return CE_Failure;
+    }
+    CPLErr ret = DecompressJPEG(d, dst, src, img.pagesize.c, scale);
+    if (CE_None == ret)
+	PutCodec(dpool, d);
+    return ret;
 }
 
 CPLErr JPEG_Band::Compress(buf_mgr &dst, buf_mgr &src)
 { 
-    return CompressJPEG(dst, src, img);
+    JPEGCompressor *c = (JPEGCompressor *)GetCodec(cpool);
+    if (NULL == c && NULL == (c = NewCompressor(img))) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: Can't initialize JPEG compressor");
+	return CE_Failure;
+    }
+    CPLErr ret = CompressJPEG(c, dst, src, img);
+    if (CE_None == ret)
+	PutCodec(cpool, c);
+    return ret;
 }
-
@@ -0,0 +1,70 @@
+/*
+ * $Id$
+ * LZ4 band
+ * LZ4 page compression and decompression functions
+ *
+ * The pages are compressed raw data, same as for the NONE and DEFLATE compressions.
+ * Decoding is stateless, the encoder state buffers are kept by the band and reused
+ * The LZ4HC option selects the high compression encoder, the level is set by the quality
+ *
+ */
+
+#include "marfa.h"
+#include <lz4.h>
+#include <lz4hc.h>
+
+LZ4_Band::LZ4_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level) :
+	GDALMRFRasterBand(pDS, image, b, level), hclevel(0)
+{
+    // Quality to HC level, 3 to 12, the default 85 is level 8
+    if (CSLTestBoolean(GetOptionValue("LZ4HC", "NO")))
+	hclevel = MIN(MAX(image.quality / 10, 3), 12);
+    // Room for pages which don't compress
+    pDS->SetPBuffer(static_cast<unsigned int>(LZ4_compressBound(image.pageSizeBytes)));
+}
+
+LZ4_Band::~LZ4_Band()
+{
+    for (size_t i = 0; i < cpool.size(); i++)
+	CPLFree(cpool[i]);
+}
+
+CPLErr LZ4_Band::Decompress(buf_mgr &dst, buf_mgr &src)
+{
+    int sz = LZ4_decompress_safe(src.buffer, dst.buffer, static_cast<int>(src.size),
+	static_cast<int>(dst.size));
+    if (sz < 0) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: LZ4 decompression error");
+	return CE_Failure;
+    }
+    // A short page is a truncated or corrupt tile
+    if (static_cast<size_t>(sz) != dst.size) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: LZ4 page size is wrong");
+	return CE_Failure;
+    }
+    return CE_None;
+}
+
+CPLErr LZ4_Band::Compress(buf_mgr &dst, buf_mgr &src)
+{
+    void *state = GetCodec(cpool);
+    if (NULL == state &&
+	NULL == (state = VSIMalloc(hclevel ? LZ4_sizeofStateHC() : LZ4_sizeofState())))
+    {
+	CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't initialize LZ4 compressor");
+	return CE_Failure;
+    }
+
+    int sz = hclevel ?
+	LZ4_compress_HC_extStateHC(state, src.buffer, dst.buffer, static_cast<int>(src.size),
+	    static_cast<int>(dst.size), hclevel) :
+	LZ4_compress_fast_extState(state, src.buffer, dst.buffer, static_cast<int>(src.size),
+	    static_cast<int>(dst.size), 1);
+    PutCodec(cpool, state);
+    if (sz <= 0) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: LZ4 compression error");
+	return CE_Failure;
+    }
+    dst.size = sz;
+    return CE_None;
+}
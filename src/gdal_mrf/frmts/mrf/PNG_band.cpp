@@ -30,6 +30,9 @@
  * PNG page compression and decompression functions
  * These functions are not methods, they reside in the global space
  *
+ * The row pointer arrays are kept by the band and reused. The PNG_PROFILE option
+ * selects the encoder filters, zlib level and strategy: FAST, BALANCED or SMALL
+ *
  */
 
 #include "marfa.h"
@@ -37,6 +40,8 @@
 CPL_C_START
 #include "../png/libpng/png.h"
 CPL_C_END
+// For the zlib levels and strategies, newer libpng doesn't include it
+#include <zlib.h>
 
 //Lucian recommended to change the following three lines to above as
 // it is causing trouble compiling for AMNH folks.
@@ -88,17 +93,33 @@ static void write_png( png_structp pngp, png_bytep data, png_size_t length) {
     }
 }
 
+/**
+ *\brief Get a row pointer array from a codec pool, allocates a new one if the pool is empty
+ */
+
+unsigned char **PNG_Band::RowPointers(std::vector<void *> &pool)
+{
+    void *rows = GetCodec(pool);
+    if (NULL == rows && NULL == (rows = VSIMalloc(sizeof(png_bytep) * img.pagesize.y)))
+	CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate PNG row pointers");
+    return (unsigned char **)rows;
+}
+
 /**
  *\brief In memory decompression of PNG file
  */
 
 CPLErr PNG_Band::DecompressPNG(buf_mgr &dst, buf_mgr &src) 
 {
-    png_bytep *png_rowp;
+    // Row pointers are kept by the band, they are acquired before the setjmp
+    png_bytep *png_rowp = RowPointers(dpool);
+    if (NULL == png_rowp)
+	return CE_Failure;
 
     // pngp=png_create_read_struct(PNG_LIBPNG_VER_STRING,0,pngEH,pngWH);
     png_structp pngp=png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (0 == pngp) {
+        PutCodec(dpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error creating PNG decompress");
         return CE_Failure;
     }
@@ -106,11 +127,14 @@ CPLErr PNG_Band::DecompressPNG(buf_mgr &dst, buf_mgr &src)
     png_infop infop=png_create_info_struct(pngp);
     if ( 0 == infop ) {
         if (pngp) png_destroy_read_struct(&pngp,&infop,0);
+        PutCodec(dpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error creating PNG info");
         return CE_Failure;
     }
 
     if (setjmp(png_jmpbuf(pngp))) {
+        png_destroy_read_struct(&pngp,&infop,0);
+        PutCodec(dpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error starting PNG decompress");
         return CE_Failure;
     }
@@ -122,14 +146,17 @@ CPLErr PNG_Band::DecompressPNG(buf_mgr &dst, buf_mgr &src)
     GInt32 height=png_get_image_height(pngp,infop);
     GInt32 byte_count=png_get_bit_depth(pngp,infop)/8;
     // Check the size
-    if (dst.size<(png_get_rowbytes(pngp,infop)*height)) {
+    if (height > img.pagesize.y || dst.size<(png_get_rowbytes(pngp,infop)*height)) {
         CPLError(CE_Failure,CPLE_AppDefined,
             "MRF: PNG Page data bigger than the buffer provided");
         png_destroy_read_struct(&pngp,&infop,0);
+        PutCodec(dpool, png_rowp);
         return CE_Failure;
     }
 
-    png_rowp=(png_bytep *)CPLMalloc(sizeof(png_bytep)*height);
+    // PNG is in net order, libpng swaps short data as it reads the rows
+    if (byte_count!=1 && !NET_ORDER)
+        png_set_swap(pngp);
 
     int rowbytes=png_get_rowbytes(pngp,infop);
     for(int i=0;i<height;i++)
@@ -140,14 +167,6 @@ CPLErr PNG_Band::DecompressPNG(buf_mgr &dst, buf_mgr &src)
     // Like pallete to RGBA
     png_read_image(pngp,png_rowp);
 
-    if (byte_count!=1) { // Swap from net order if data is short
-        for (int i=0;i<height;i++) {
-            unsigned short int*p=(unsigned short int *)png_rowp[i];
-            for (int j=0; j<rowbytes/2; j++,p++)
-				*p=net16(*p);
-        }
-    }
-
     //    ppmWrite("Test.ppm",(char *)data,ILSize(512,512,1,4,0));
     // Required
     png_read_end(pngp,infop);
@@ -155,8 +174,8 @@ CPLErr PNG_Band::DecompressPNG(buf_mgr &dst, buf_mgr &src)
     // png_set_rows(pngp,infop,png_rowp);
     // png_read_png(pngp,infop,PNG_TRANSFORM_IDENTITY,0);
 
-    CPLFree(png_rowp);
     png_destroy_read_struct(&pngp,&infop,0);
+    PutCodec(dpool, png_rowp);
     return CE_None;
 }
 
@@ -173,20 +192,27 @@ CPLErr PNG_Band::CompressPNG(buf_mgr &dst, buf_mgr &src)
     png_infop infop;
     buf_mgr mgr=dst;
 
+    png_bytep *png_rowp = RowPointers(cpool);
+    if (NULL == png_rowp)
+	return CE_Failure;
+
     pngp=png_create_write_struct(PNG_LIBPNG_VER_STRING,NULL,pngEH,pngWH);
     if (!pngp) {
+        PutCodec(cpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error creating png structure");
         return CE_Failure;
     }
     infop=png_create_info_struct(pngp);
     if (!infop) {
         png_destroy_write_struct(&pngp,NULL);
+        PutCodec(cpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error creating png info structure");
         return CE_Failure;
     }
 
     if (setjmp(png_jmpbuf(pngp))) {
         png_destroy_write_struct(&pngp,&infop);
+        PutCodec(cpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error during png init");
         return CE_Failure;
     }
@@ -203,6 +229,8 @@ CPLErr PNG_Band::CompressPNG(buf_mgr &dst, buf_mgr &src)
     case 3: png_ctype=PNG_COLOR_TYPE_RGB; break;
     case 4: png_ctype=PNG_COLOR_TYPE_RGB_ALPHA; break;
     default: { // This never happens if we check at the open
+        png_destroy_write_struct(&pngp,&infop);
+        PutCodec(cpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF:PNG Write with %d colors called",
             img.pagesize.c);
         return CE_Failure;
@@ -213,9 +241,14 @@ CPLErr PNG_Band::CompressPNG(buf_mgr &dst, buf_mgr &src)
         GDALGetDataTypeSize(img.dt), png_ctype,
         PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
-	// Optional, force certain filters only.  Makes it somewhat faster but worse compression
-	// png_set_filter(pngp, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
-	
+    // Encoder profile, the library defaults are used when not set
+    if (png_filters >= 0)
+	png_set_filter(pngp, PNG_FILTER_TYPE_BASE, png_filters);
+    if (png_level >= 0)
+	png_set_compression_level(pngp, png_level);
+    if (png_strategy >= 0)
+	png_set_compression_strategy(pngp, png_strategy);
+
 #if defined(PNG_LIBPNG_VER) && (PNG_LIBPNG_VER > 10200)
 	png_uint_32 mask, flags;
 
@@ -228,8 +261,6 @@ CPLErr PNG_Band::CompressPNG(buf_mgr &dst, buf_mgr &src)
 
 #endif
 
-	// Should let the quality control the compression level
-
     // Write the palete and the transparencies if they exist
     if (PNGColors!=NULL)
     {
@@ -240,30 +271,27 @@ CPLErr PNG_Band::CompressPNG(buf_mgr &dst, buf_mgr &src)
 
     png_write_info (pngp,infop);
 
-    png_bytep *png_rowp=(png_bytep *)CPLMalloc(sizeof(png_bytep)*img.pagesize.y);
-
     if (setjmp(png_jmpbuf(pngp))) {
-        CPLFree(png_rowp);
         png_destroy_write_struct(&pngp,&infop);
+        PutCodec(cpool, png_rowp);
         CPLError(CE_Failure,CPLE_AppDefined,"MRF: Error during png compression");
         return CE_Failure;
     }
 
+    // Swap to net order if data is short, libpng does it as it writes the rows
+    if (img.dt!=GDT_Byte && !NET_ORDER)
+        png_set_swap(pngp);
+
     int rowbytes=png_get_rowbytes(pngp,infop);
-    for (int i=0;i<img.pagesize.y;i++) {
+    for (int i=0;i<img.pagesize.y;i++)
         png_rowp[i]=(png_bytep)(src.buffer+i*rowbytes);
-        if (img.dt!=GDT_Byte) { // Swap to net order if data is short
-            unsigned short int*p=(unsigned short int *)png_rowp[i];
-            for (int j=0;j<rowbytes/2;j++,p++) *p=net16(*p);
-        }
-    }
 
     png_write_image(pngp,png_rowp);
     png_write_end(pngp,infop);
 
     // Done
-    CPLFree(png_rowp);
     png_destroy_write_struct(&pngp,&infop);
+    PutCodec(cpool, png_rowp);
     
     // Done
     // mgr.size holds the available bytes, so the size of the compressed png
@@ -291,9 +319,32 @@ CPLErr PNG_Band::Compress(buf_mgr &dst, buf_mgr &src)
  */
 
 PNG_Band::PNG_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level) : 
-	GDALMRFRasterBand(pDS,image,b,level),PNGColors(NULL),PNGAlpha(NULL)
+	GDALMRFRasterBand(pDS,image,b,level),PNGColors(NULL),PNGAlpha(NULL),
+	png_filters(-1),png_level(-1),png_strategy(-1)
 
 {
+    // Encoder profiles, filter set, zlib level and strategy
+    const char *profile = GetOptionValue("PNG_PROFILE", NULL);
+    if (profile != NULL) {
+	if (EQUAL(profile, "FAST")) {
+	    png_filters = PNG_FILTER_SUB;
+	    png_level = Z_BEST_SPEED;
+	}
+	else if (EQUAL(profile, "BALANCED")) {
+	    png_filters = PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH;
+	    png_level = Z_DEFAULT_COMPRESSION;
+	    png_strategy = Z_FILTERED;
+	}
+	else if (EQUAL(profile, "SMALL")) {
+	    png_filters = PNG_ALL_FILTERS;
+	    png_level = Z_BEST_COMPRESSION;
+	    png_strategy = Z_FILTERED;
+	}
+	else
+	    CPLError(CE_Warning, CPLE_NotSupported,
+		"MRF: Unknown PNG_PROFILE %s, using the defaults", profile);
+    }
+
     if (image.comp==IL_PPNG)
     {  // Convert the GDAL LUT to PNG style
         GDALColorTable *poCT=GetColorTable();
@@ -327,4 +378,8 @@ PNG_Band::PNG_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level)
 PNG_Band::~PNG_Band() {
     CPLFree(PNGColors);
     CPLFree(PNGAlpha);
+    for (size_t i = 0; i < cpool.size(); i++)
+	CPLFree(cpool[i]);
+    for (size_t i = 0; i < dpool.size(); i++)
+	CPLFree(dpool[i]);
 }
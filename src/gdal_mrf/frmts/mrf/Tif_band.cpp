@@ -31,117 +31,202 @@
 
 #include "marfa.h"
 
-// Returns a string in /vsimem/ + prefix + count that doesn't exist when this function gets called
-// It is not completely safe, open the result as soon as possible
-CPLString uniq_memfname(const char *prefix)
+CPL_C_START
+#include "tiffio.h"
+CPL_C_END
+
+//
+// The TIFF pages are encoded and decoded by libtiff directly in memory, using client I/O
+// procedures over a buf_mgr.  There is no GDAL dataset or /vsimem file involved
+//
+
+// A TIFF in memory, size is the end of the data, buffer.size the capacity
+typedef struct {
+    buf_mgr buf;
+    toff_t pos;
+    toff_t size;
+} TIFMem;
+
+static tmsize_t memRead(thandle_t h, void *data, tmsize_t n)
 {
+    TIFMem *m = (TIFMem *)h;
+    if (m->pos >= m->size)
+	return 0;
+    if (toff_t(n) > m->size - m->pos)
+	n = tmsize_t(m->size - m->pos);
+    memcpy(data, m->buf.buffer + m->pos, size_t(n));
+    m->pos += n;
+    return n;
+}
+
+// Fails if the output doesn't fit
+static tmsize_t memWrite(thandle_t h, void *data, tmsize_t n)
+{
+    TIFMem *m = (TIFMem *)h;
+    if (m->pos + n > m->buf.size)
+	return 0;
+    // Seeks past the end leave a gap, zero it
+    if (m->pos > m->size)
+	memset(m->buf.buffer + m->size, 0, size_t(m->pos - m->size));
+    memcpy(m->buf.buffer + m->pos, data, size_t(n));
+    m->pos += n;
+    if (m->pos > m->size)
+	m->size = m->pos;
+    return n;
+}
+
+static toff_t memSeek(thandle_t h, toff_t off, int whence)
+{
+    TIFMem *m = (TIFMem *)h;
+    switch (whence) {
+    case SEEK_SET: m->pos = off; break;
+    case SEEK_CUR: m->pos += off; break;
+    case SEEK_END: m->pos = m->size + off; break;
+    }
+    return m->pos;
+}
+
+static int memClose(thandle_t) { return 0; }
+
+static toff_t memSize(thandle_t h) { return ((TIFMem *)h)->size; }
+
+// Reads use the buffer directly
+static int memMap(thandle_t h, void **base, toff_t *size)
+{
+    TIFMem *m = (TIFMem *)h;
+    *base = m->buf.buffer;
+    *size = m->size;
+    return 1;
+}
+
+// Writes can't be mapped
+static int memNoMap(thandle_t, void **, toff_t *) { return 0; }
 
-// Define MRF_LOCAL_TMP to use local files instead of RAM
-// #define MRF_LOCAL_TMP
-#if defined(MRF_LOCAL_TMP)
-    return CPLGenerateTempFilename(prefix);
-#else
-    CPLString fname;
-    VSIStatBufL statb;
-    static unsigned int cnt=0;
-    do fname.Printf("/vsimem/%s_%08x",prefix, cnt++);
-    while (!VSIStatL(fname, &statb));
-    return fname;
-#endif
+static void memUnmap(thandle_t, void *, toff_t) {}
+
+static uint16 SampleFormat(GDALDataType dt)
+{
+    switch (dt) {
+    case GDT_Int16:
+    case GDT_Int32: return SAMPLEFORMAT_INT;
+    case GDT_Float32:
+    case GDT_Float64: return SAMPLEFORMAT_IEEEFP;
+    default: return SAMPLEFORMAT_UINT;
+    }
 }
 
 //
-// Uses GDAL to create a temporary TIF file, using the band create options
-// copies the content to the destination buffer then erases the temp TIF
+// Writes a single image TIFF with deflate compression, one tile if the page size allows it,
+// otherwise one strip.  Three band byte pages are RGB, same as the GTiff driver does
 //
-CPLErr CompressTIF(buf_mgr &dst, buf_mgr &src, const ILImage &img, char **papszOptions)
+CPLErr CompressTIF(buf_mgr &dst, buf_mgr &src, const ILImage &img, int zlevel)
 {
-    CPLErr ret;
-    GDALDriver *poTiffDriver = GetGDALDriverManager()->GetDriverByName("GTiff");
-    VSIStatBufL statb;
-    CPLString fname = uniq_memfname("mrf_tif_write");
-
-    GDALDataset *poTiff = poTiffDriver->Create(fname, img.pagesize.x, img.pagesize.y,
-	img.pagesize.c, img.dt, papszOptions );
-
-    // Read directly to avoid double caching in GDAL
-    // Unfortunately not possible for multiple bands
-    if (img.pagesize.c == 1) {
-	ret = poTiff->GetRasterBand(1)->WriteBlock(0,0,src.buffer);
-    } else {
-	ret = poTiff->RasterIO(GF_Write, 0,0,img.pagesize.x,img.pagesize.y, 
-	    src.buffer, img.pagesize.x, img.pagesize.y, img.dt, img.pagesize.c, 
-	    NULL, 0,0,0);
+    TIFMem mem = {dst, 0, 0};
+    TIFF *tif = TIFFClientOpen("MRF page", "w", (thandle_t)&mem,
+	memRead, memWrite, memSeek, memClose, memSize, memNoMap, memUnmap);
+    if (NULL == tif) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: TIFF, can't create page");
+	return CE_Failure;
     }
-    if (CE_None != ret)	return ret;
-    GDALClose(poTiff);
 
-    // Check that we can read the file
-    if (VSIStatL(fname, &statb))
-    {
-	CPLError(CE_Failure,CPLE_AppDefined,
-	    CPLString().Printf("MRF: TIFF, can't stat %s", fname.c_str()));
-        return CE_Failure;
+    uint16 spp = uint16(img.pagesize.c);
+    int rgb = (3 == spp && GDT_Byte == img.dt);
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, uint32(img.pagesize.x));
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, uint32(img.pagesize.y));
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, uint16(GDALGetDataTypeSize(img.dt)));
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, spp);
+    TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SampleFormat(img.dt));
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, rgb ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+    int extra = spp - (rgb ? 3 : 1);
+    if (extra > 0) {
+	std::vector<uint16> types(extra, uint16(EXTRASAMPLE_UNSPECIFIED));
+	TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, uint16(extra), &types[0]);
     }
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, zlevel);
 
-    if (statb.st_size > dst.size)
-    {
-	CPLError(CE_Failure,CPLE_AppDefined,
-	    CPLString().Printf("MRF: TIFF, Tiff generated is too large"));
-        return CE_Failure;
+    // Tile sizes have to be multiples of 16
+    int tiled = (0 == img.pagesize.x % 16 && 0 == img.pagesize.y % 16);
+    tmsize_t written;
+    if (tiled) {
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, uint32(img.pagesize.x));
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, uint32(img.pagesize.y));
+	written = TIFFWriteEncodedTile(tif, 0, src.buffer, img.pageSizeBytes);
+    }
+    else {
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, uint32(img.pagesize.y));
+	written = TIFFWriteEncodedStrip(tif, 0, src.buffer, img.pageSizeBytes);
     }
 
-    VSILFILE *pf = VSIFOpenL(fname,"rb");
-    if (pf == NULL)
-    {
-	CPLError(CE_Failure,CPLE_AppDefined,
-	    CPLString().Printf("MRF: TIFF, can't open %s", fname.c_str()));
-        return CE_Failure;
+    int ok = (written == img.pageSizeBytes) && TIFFWriteDirectory(tif);
+    TIFFClose(tif);
+    if (!ok) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: TIFF, error encoding page, output might be too large");
+	return CE_Failure;
     }
-    
-    VSIFReadL(dst.buffer, statb.st_size, 1, pf);
-    dst.size = statb.st_size;
-    VSIFCloseL(pf);
-    VSIUnlink(fname);
 
+    dst.size = size_t(mem.size);
     return CE_None;
 }
 
-// Read from a RAM Tiff. This is rather generic
+//
+// Read from a RAM Tiff, it has to match the page size, type and band count.
+// Accepts a single tile or strips, as written by this driver or the GTiff one
+//
 CPLErr DecompressTIF(buf_mgr &dst, buf_mgr &src, const ILImage &img)
 {
-    CPLString fname = uniq_memfname("mrf_tif_read");
-    VSILFILE *fp = VSIFileFromMemBuffer(fname, (GByte *)(src.buffer), src.size, false);
-    // Comes back opened, but we can't use it
-    if (fp)
-	VSIFCloseL(fp);
-    else {
-	CPLError(CE_Failure,CPLE_AppDefined,
-	    CPLString().Printf("MRF: TIFF, can't open %s as a temp file", fname.c_str()));
-        return CE_Failure;
+    TIFMem mem = {src, 0, src.size};
+    TIFF *tif = TIFFClientOpen("MRF page", "r", (thandle_t)&mem,
+	memRead, memWrite, memSeek, memClose, memSize, memMap, memUnmap);
+    if (NULL == tif) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: TIFF, can't open page as a Tiff");
+	return CE_Failure;
     }
-    GDALDataset *poTiff = reinterpret_cast<GDALDataset*>(GDALOpen(fname, GA_ReadOnly));
-    if (!fp) {
-	CPLError(CE_Failure,CPLE_AppDefined,
-	    CPLString().Printf("MRF: TIFF, can't open page as a Tiff"));
-        return CE_Failure;
+
+    uint32 w = 0, h = 0;
+    uint16 spp = 1, bps = 1, planar = PLANARCONFIG_CONTIG;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+    if (int(w) != img.pagesize.x || int(h) != img.pagesize.y || int(spp) != img.pagesize.c
+	|| int(bps) != GDALGetDataTypeSize(img.dt) || (spp > 1 && PLANARCONFIG_CONTIG != planar)
+	|| dst.size < size_t(img.pageSizeBytes))
+    {
+	TIFFClose(tif);
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: TIFF, page doesn't match the MRF structure");
+	return CE_Failure;
     }
 
-    CPLErr ret;
-    // Bypass the GDAL caching
-    if (img.pagesize.c == 1) {
-	ret = poTiff->GetRasterBand(1)->ReadBlock(0,0,dst.buffer);
-    } else {
-	ret = poTiff->RasterIO(GF_Read,0,0,img.pagesize.x,img.pagesize.y, 
-	    dst.buffer, img.pagesize.x, img.pagesize.y, img.dt, img.pagesize.c, 
-	    NULL, 0,0,0);
+    CPLErr ret = CE_None;
+    if (TIFFIsTiled(tif)) {
+	uint32 tw = 0, th = 0;
+	TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+	TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+	if (tw != w || th != h || 
+	    TIFFReadEncodedTile(tif, 0, dst.buffer, img.pageSizeBytes) != img.pageSizeBytes)
+	    ret = CE_Failure;
     }
-    GDALClose(poTiff);
-    if (CE_None != ret)
-	return ret;
+    else {
+	// Strips are consecutive
+	tmsize_t off = 0;
+	for (uint32 s = 0; s < TIFFNumberOfStrips(tif) && off < img.pageSizeBytes; s++) {
+	    tmsize_t n = TIFFReadEncodedStrip(tif, s, dst.buffer + off, img.pageSizeBytes - off);
+	    if (n <= 0)
+		break;
+	    off += n;
+	}
+	if (off != img.pageSizeBytes)
+	    ret = CE_Failure;
+    }
+    TIFFClose(tif);
 
-    VSIUnlink(fname);
-    return CE_None;
+    if (CE_None != ret)
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: TIFF, error decoding page");
+    return ret;
 }
 
 CPLErr TIF_Band::Decompress(buf_mgr &dst, buf_mgr &src) 
@@ -151,7 +236,7 @@ CPLErr TIF_Band::Decompress(buf_mgr &dst, buf_mgr &src)
 
 CPLErr TIF_Band::Compress(buf_mgr &dst, buf_mgr &src) 
 { 
-    return CompressTIF(dst,src,img, papszOptions); 
+    return CompressTIF(dst, src, img, zlevel); 
 }
 
 TIF_Band::TIF_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level):
@@ -160,19 +245,14 @@ TIF_Band::TIF_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level):
     // Increase the page buffer by 1K in case Tiff expands data
     pDS->SetPBuffer(image.pageSizeBytes + 1024);
 
-    // Static create options for TIFF tiles
-    papszOptions = CSLAddNameValue(NULL, "COMPRESS", "DEFLATE");
-    papszOptions = CSLAddNameValue(papszOptions, "TILED", "Yes");
-    papszOptions = CSLAddNameValue(papszOptions, "BLOCKXSIZE", CPLString().Printf("%d",img.pagesize.x));
-    papszOptions = CSLAddNameValue(papszOptions, "BLOCKYSIZE", CPLString().Printf("%d",img.pagesize.y));
+    // Deflate level for the TIFF tiles
     int q = img.quality / 10;
     // Move down so the default 85 maps to 6.  This makes the maz ZLEVEL 8, which is OK
     if (q >2) q-=2;
-    papszOptions = CSLAddNameValue(papszOptions, "ZLEVEL", CPLString().Printf("%d",q));
+    zlevel = q;
 };
 
 TIF_Band::~TIF_Band() 
 {
-    CSLDestroy(papszOptions);
 };
 
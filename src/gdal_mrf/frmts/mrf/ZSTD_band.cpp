@@ -0,0 +1,69 @@
+/*
+ * $Id$
+ * Zstandard band
+ * Zstandard page compression and decompression functions
+ *
+ * The pages are compressed raw data, same as for the NONE and DEFLATE compressions.
+ * The compression contexts are kept by the band and reused from page to page
+ *
+ */
+
+#include "marfa.h"
+#include <zstd.h>
+
+ZSTD_Band::ZSTD_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level) :
+	GDALMRFRasterBand(pDS, image, b, level)
+{
+    // Bring the quality to 1 to 9, the default 85 is level 8
+    zlevel = MIN(MAX(image.quality / 10, 1), ZSTD_maxCLevel());
+    // Room for pages which don't compress
+    pDS->SetPBuffer(static_cast<unsigned int>(ZSTD_compressBound(image.pageSizeBytes)));
+}
+
+ZSTD_Band::~ZSTD_Band()
+{
+    for (size_t i = 0; i < cpool.size(); i++)
+	ZSTD_freeCCtx((ZSTD_CCtx *)cpool[i]);
+    for (size_t i = 0; i < dpool.size(); i++)
+	ZSTD_freeDCtx((ZSTD_DCtx *)dpool[i]);
+}
+
+CPLErr ZSTD_Band::Decompress(buf_mgr &dst, buf_mgr &src)
+{
+    ZSTD_DCtx *ctx = (ZSTD_DCtx *)GetCodec(dpool);
+    if (NULL == ctx && NULL == (ctx = ZSTD_createDCtx())) {
+	CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't initialize ZSTD decompressor");
+	return CE_Failure;
+    }
+
+    size_t sz = ZSTD_decompressDCtx(ctx, dst.buffer, dst.size, src.buffer, src.size);
+    PutCodec(dpool, ctx);
+    if (ZSTD_isError(sz)) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: ZSTD decompression error %s", ZSTD_getErrorName(sz));
+	return CE_Failure;
+    }
+    // A short page is a truncated or corrupt tile
+    if (sz != dst.size) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: ZSTD page size is wrong");
+	return CE_Failure;
+    }
+    return CE_None;
+}
+
+CPLErr ZSTD_Band::Compress(buf_mgr &dst, buf_mgr &src)
+{
+    ZSTD_CCtx *ctx = (ZSTD_CCtx *)GetCodec(cpool);
+    if (NULL == ctx && NULL == (ctx = ZSTD_createCCtx())) {
+	CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't initialize ZSTD compressor");
+	return CE_Failure;
+    }
+
+    size_t sz = ZSTD_compressCCtx(ctx, dst.buffer, dst.size, src.buffer, src.size, zlevel);
+    PutCodec(cpool, ctx);
+    if (ZSTD_isError(sz)) {
+	CPLError(CE_Failure, CPLE_AppDefined, "MRF: ZSTD compression error %s", ZSTD_getErrorName(sz));
+	return CE_Failure;
+    }
+    dst.size = sz;
+    return CE_None;
+}
@@ -15,6 +15,7 @@
 #define GDAL_FRMTS_MRF_MARFA_H_INCLUDED
 
 #include <gdal_pam.h>
+#include <cpl_atomic_ops.h>
 #include <ogr_srs_api.h>
 #include <ogr_spatialref.h>
 
@@ -44,14 +45,44 @@
 // Force LERC to be included, normally off, detected in the makefile
 // #define LERC
 
+// Zstandard compression, needs libzstd, normally set by the makefile
+// #define ZSTD
+
+// LZ4 compression, needs liblz4, normally set by the makefile
+// #define LZ4
+
+// Use libdeflate for DEFLATE when possible, zlib otherwise.  Normally set by the makefile
+// #define LIBDEFLATE
+
+// SSE2 code paths, SSE2 is always present on x64.  Define MRF_NO_SSE2 to disable
+#if !defined(MRF_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MRF_USE_SSE2
+#endif
+
+// AVX2 code paths, built with GCC 4.9 or newer, used only if the CPU has AVX2.  Define MRF_NO_AVX2 to disable
+#if defined(MRF_USE_SSE2) && !defined(MRF_NO_AVX2) && defined(__GNUC__) && !defined(__clang__) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define MRF_USE_AVX2
+// Compiles a function for AVX2, call it only when CPUHasAVX2() is true
+#define MRF_AVX2 __attribute__((target("avx2")))
+#endif
+
 // These are a pain to maintain in sync.  They should be replaced with 
 // C++11 uniform initializers.  The externs reside in util.cpp
 enum ILCompression { IL_PNG=0, IL_PPNG, IL_JPEG, IL_NONE , IL_ZLIB, IL_TIF, 
 #if defined(LERC)
 	IL_LERC, 
+#endif
+#if defined(ZSTD)
+	IL_ZSTD,
+#endif
+#if defined(LZ4)
+	IL_LZ4,
 #endif
 	IL_ERR_COMP} ;
 enum ILOrder { IL_Interleaved=0, IL_Separate, IL_Sequential , IL_ERR_ORD} ;
+// Predictors, applied to the raw page before compression
+enum ILPredictor { IL_NOPRED=0, IL_SHUFFLE, IL_DELTA };
 extern char const **ILComp_Name;
 extern char const **ILComp_Ext;
 extern char const **ILOrder_Name;
@@ -64,12 +95,43 @@ typedef struct {
     size_t size;
 } buf_mgr;
 
+/**
+ *\brief A pool of scratch buffers, reused across tiles
+ *
+ * Buffers are kept when released and grow to the largest size requested,
+ * so once the pool is warmed up it does not allocate anymore
+ */
+class MRFBufferPool {
+public:
+    MRFBufferPool() : hits(0), grows(0), hMutex(NULL) {};
+    ~MRFBufferPool();
+    // Returns a buffer of at least sz bytes, or NULL
+    void *Acquire(size_t sz);
+    // Return a buffer obtained from Acquire to the pool
+    void Release(void *buffer);
+    // Number of requests served without allocation, and those which had to allocate
+    void GetStats(GIntBig &nhits, GIntBig &ngrows);
+
+private:
+    std::vector<buf_mgr> avail;
+    std::vector<buf_mgr> inuse;
+    GIntBig hits, grows;
+    // Acquire and Release can be called from multiple threads
+    void *hMutex;
+};
+
 // A tile index record
 typedef struct {
     GIntBig offset;
     GIntBig size;
 } ILIdx;
 
+// An index record waiting to be written, for buffered writes
+typedef struct {
+    GIntBig pos;	// Location in the index file
+    ILIdx tinfo;	// Record, in net order
+} ILIdxPending;
+
 // Size of an image, also used as a tile or pixel location
 struct ILSize {
     GInt32 x,y,z,c,l;
@@ -90,6 +152,12 @@ std::ostream& operator<<(std::ostream &out, const ILSize& sz);
 std::ostream& operator<<(std::ostream &out, const ILIdx& t);
 
 bool is_Endianess_Dependent(GDALDataType dt, ILCompression comp);
+// Returns true if the buffer contains only the ndv value
+int isAllVal(GDALDataType gt, void *b, size_t bytecount, double ndv);
+// Same for pixel interleaved data, band c is checked against its own ndv[c]
+int isAllVal(GDALDataType gt, void *b, size_t bytecount, const double *ndv, int cstride);
+// Fills pixel interleaved data, band c with ndv[c]
+void FillPixels(GDALDataType gt, void *b, size_t bytecount, const double *ndv, int cstride);
 
 // #define PPMW
 #ifdef PPMW
@@ -192,12 +260,74 @@ GDALColorEntry HSVSwap(const GDALColorEntry& cein);
 GIntBig IdxSize(const ILImage &full, const int scale=0);
 // Similar to uncompress() from zlib, accepts the ZFLAG_RAW
 // Return true if it worked
-int ZUnPack(const buf_mgr &src, buf_mgr &dst, int flags);
+// If state is not NULL, the codec state is kept there and reused, it starts as NULL
+int ZUnPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state = NULL);
 // Similar to compress2() but with flags to control zlib features
 // Returns true if it worked
-int ZPack(const buf_mgr &src, buf_mgr &dst, int flags);
+// A state is reused only with the same flags
+int ZPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state = NULL);
+// Frees a ZPack (pack is true) or a ZUnPack state
+void ZFreeState(void *state, bool pack);
 // checks that the file exists and is at least sz, if access is update it extends it
 int CheckFileSize(const char *fname, GIntBig sz, GDALAccess eAccess);
+// Creates a file of size sz, it appears in place at full size or not at all
+// Returns false if this can't be done, an existing file is left alone and counts as success
+int NewFileAtomic(const char *fname, GIntBig sz);
+// Positional read handles, for files which are only read
+// Open returns -1 if not supported for this file, for example /vsi files
+int PReadOpen(const char *fname);
+void PReadClose(int fd);
+// Reads size bytes at offset without touching any shared file position, returns bytes read
+size_t PRead(int fd, void *buff, size_t size, GIntBig offset);
+// Thread count from an option value, a number or ALL_CPUS, at least 1
+int ThreadCount(const char *value);
+// True if the AVX2 code paths can be used, the MRF_NO_AVX2 config option turns them off
+int CPUHasAVX2();
+// Calls pfn(arg, i) for every i from 0 to count-1, using up to nThreads threads
+// Returns when all the calls are done
+void RunParallel(int nThreads, int count, void (*pfn)(void *, int), void *arg);
+// Tell the OS that a file range will be read soon, if possible
+void PReadAdvise(int fd, GIntBig offset, GIntBig size);
+// Handle used only for locking a local file, -1 if not possible
+// Close it with PReadClose, which releases the lock held by this handle
+int LockOpen(const char *fname);
+// Takes or releases an exclusive advisory lock owned by the handle, waits for it
+// Returns false if the lock didn't work or if the system has no such locks
+bool FileLock(int fd, bool lock);
+// Read only memory map of the first size bytes of a file, NULL if not possible
+void *MMapOpen(int fd, size_t size);
+void MMapClose(void *p, size_t size);
+// Split count pixels of c interleaved samples of sz bytes into c separate buffers, in one pass
+// With swab set the values are also byte swapped
+void deinterleave(char **dst, const char *src, size_t count, int c, int sz, bool swab = false);
+// Merge c separate buffers of count samples of sz bytes into pixel interleaved form
+void interleave(char *dst, char **src, size_t count, int c, int sz);
+// Swap the bytes of count values of sz bytes, in place
+void swab_values(char *b, size_t count, int sz);
+
+// The raw page predictors, in mrf_band.cpp
+// Byte planes of count values of sz bytes, and back
+void shuffle(char *dst, const char *src, size_t count, int sz);
+void unshuffle(char *dst, const char *src, size_t count, int sz);
+// Line differences of a page, the inverse works in place
+void delta_buff(buf_mgr &dst, const buf_mgr &src, const ILImage &img);
+void undelta_buff(buf_mgr &src, const ILImage &img);
+
+// The overview kernels, in mrf_overview.cpp, for every data type
+// AverageByFour reduces xsz by ysz 2x2 blocks in place, skipping ndv if given
+// MatchCount returns the number of values equal to val
+#define MRF_OVR_KERNELS(T) \
+void AverageByFour(T *buff, int xsz, int ysz); \
+void AverageByFour(T *buff, int xsz, int ysz, T ndv); \
+int MatchCount(T *buff, int sz, T val);
+MRF_OVR_KERNELS(GByte)
+MRF_OVR_KERNELS(GUInt16)
+MRF_OVR_KERNELS(GInt16)
+MRF_OVR_KERNELS(GUInt32)
+MRF_OVR_KERNELS(GInt32)
+MRF_OVR_KERNELS(float)
+MRF_OVR_KERNELS(double)
+#undef MRF_OVR_KERNELS
 
 // Number of pages of size psz needed to hold n elements
 static inline int pcount(const int n, const int sz) {
@@ -216,10 +346,40 @@ static inline const ILSize pcount(const ILSize &size, const ILSize &psz) {
     return pcnt;
 }
 
+// packs a block of a given type, with a stride
+// Count is the number of items that need to be copied
+// These are separate to allow for optimization
+
+template <typename T> void cpy_stride_in(void *dst, 
+	const void *src, int c, int stride)
+{
+    T *s=(T *)src;
+    T *d=(T *)dst;
+
+    while (c--) {
+	*d++=*s;
+	s+=stride;
+    }
+}
+
+template <typename T> void cpy_stride_out(void *dst, 
+	const void *src, int c, int stride)
+{
+    T *s=(T *)src;
+    T *d=(T *)dst;
+
+    while (c--) {
+	*d=*s++;
+	d+=stride;
+    }
+}
+
 // Wrapper around the VISFile, remembers how the file was opened
 typedef struct {
     VSILFILE *FP;
     GDALRWFlag acc;
+    int fd; // Positional read handle, -1 if not available
+    volatile int ready; // Set after the fields above are final, read it with CPLAtomicAdd
 } VF;
 
 // Offset of index, pos is in pages
@@ -286,6 +446,10 @@ protected:
     virtual CPLErr IRasterIO( GDALRWFlag, int, int, int, int,
 	void *, int, int, GDALDataType,
 	int, int *, int, int, int );
+    // Decimated read from JPEG tiles decoded at a reduced size
+    CPLErr ReadReduced(int nXOff, int nYOff, int nBufXSize, int nBufYSize, int scale,
+	void *pData, GDALDataType eBufType, int nBandCount, int *panBandMap,
+	int nPixelSpace, int nLineSpace, int nBandSpace);
 
     virtual CPLErr IBuildOverviews( const char*, int, int*, int, int*, 
 	GDALProgressFunc, void* );
@@ -293,21 +457,47 @@ protected:
 
     // Write a tile, the infooffset is the relative position in the index file
     virtual CPLErr WriteTile(void *buff, GUIntBig infooffset, GUIntBig size=0);
+    // Write the buffered tiles and index records, if any
+    CPLErr FlushWrites();
 
     // For versioned MRFs, add a version
     CPLErr AddVersion();
 
+    // PatchOverview for one level, on multiple threads
+    CPLErr PatchOverviewParallel(std::vector<GDALRasterBand *> &src_b, std::vector<GDALRasterBand *> &dst_b,
+	int BlockXOut, int BlockYOut, int WidthOut, int HeightOut, int nThreads);
+
+    // Builds nLevels consecutive scale 2 overviews in one pass over the srcLevel tiles
+    CPLErr BuildPyramid(int srcLevel, int nLevels);
+
+    // Copy the base level from a source, compressing on multiple threads
+    CPLErr CopyParallel(GDALDataset *poSrc, int nThreads, GDALProgressFunc pfnProgress, void *pProgressData);
+
     // Read the index record itself
     CPLErr ReadTileIdx(ILIdx &tinfo, const ILSize &pos, const ILImage &img, const GIntBig bias=0);
+    // Map or load the whole index in memory, if IDX_MMAP is on or forced. Returns true if it is in memory
+    int IdxInMemory(bool force = false);
+    int LoadIdxMem(bool force);
+    // Read and decode the tiles of a block range into the block cache, with coalesced reads
+    // With bAdviseOnly, the OS is only told which ranges will be read
+    CPLErr PreloadTiles(int l, int bx0, int by0, int bx1, int by1, int nBandCount, int *panBandMap,
+	int bAdviseOnly = FALSE);
 
     VSILFILE *IdxFP();
     VSILFILE *DataFP();
+    // Open the files, called under the dataset mutex
+    VSILFILE *OpenIdxFP();
+    VSILFILE *OpenDataFP();
+    // Thread safe reads from the index and data files, return bytes read
+    size_t ReadIdxAt(void *buffer, GIntBig offset, size_t size);
+    size_t ReadDataAt(void *buffer, GIntBig offset, size_t size);
+    size_t ReadAt(VF &f, void *buffer, GIntBig offset, size_t size);
     GDALRWFlag IdxMode() { 
-	if (!ifp.FP) IdxFP();
+	IdxFP();
 	return ifp.acc;
     };
     GDALRWFlag DataMode() {
-	if (!dfp.FP) DataFP();
+	DataFP();
 	return dfp.acc; 
     };
     GDALDataset *GetSrcDS();
@@ -356,6 +546,9 @@ protected:
     void *pbuffer;
     unsigned int pbsize;
 
+    // Scratch buffers for compressed tiles, used in read and fetch
+    MRFBufferPool bpool;
+
     ILSize tile; // ID of tile present in buffer
     // Holds bits, to be used in pixel interleaved (up to 64 bands)
     GIntBig bdirty;
@@ -372,6 +565,35 @@ protected:
 
     VF dfp;
     VF ifp;
+    // Serializes the file opening, shared file position use and writes
+    void *hMutex;
+    // Serializes the fetches from the caching source, held while the source is read
+    void *hFetchMutex;
+
+    // Write behind buffer, tiles are appended here then written in one go
+    char *wbuffer;
+    size_t wbsize;	// Capacity, zero if not buffering
+    size_t wbused;
+    GIntBig wboffset;	// Data file offset of the buffer start
+    int wbstate;	// 0 not set up yet, 1 buffering, -1 not buffering
+    std::vector<ILIdxPending> pending;
+
+    // Caching MRF appends, serialized across processes by a lock on the data file
+    int lockfd;
+    int lockstate;	// 0 not tried, 1 locking, -1 verify by reading back
+
+    // How the cloned source index gets copied, from CLONE_INDEX and CLONE_CHUNK
+    // Chunks on demand, all of it on the first miss, or never, reading the source index instead
+    enum { CLONE_CHUNK = 1, CLONE_BULK, CLONE_LAZY };
+    // clonemode is published with CPLAtomicAdd, after clonechunk, and read without the mutex
+    volatile int clonemode;	// 0 not set up yet
+    GIntBig clonechunk;	// Bytes, CHUNK mode only
+    GIntBig clonecopies, clonebytes;
+
+    // The index file content, when held in memory
+    char *idxmem;
+    GIntBig idxmemsz;
+    volatile int idxmemstate; // 0 not tried, 1 mapped, 2 loaded, -1 not available
 
     std::vector<double> vNoData,vMin,vMax;
 };
@@ -395,12 +617,27 @@ public:
     CPLErr FetchBlock(int xblk, int yblk, void *buffer = NULL);
     // Fetch a block from a cloned MRF
     CPLErr FetchClonedBlock(int xblk, int yblk, void *buffer = NULL);
+    // Compress and store a page fetched from the source, ndv holds the NoData of the page bands
+    CPLErr CachePage(const ILSize &req, void *page, const double *ndv);
 
     // Block not stored on disk
     CPLErr FillBlock(void *buffer);
-
-    // de-interlace a buffer in pixel blocks
-    CPLErr RB(int xblk, int yblk, buf_mgr src, void *buffer);
+    // The NoData values of the bands interleaved in this band's pages, 0 when not set
+    void PageNoData(std::vector<double> &ndv);
+
+    // de-interlace a buffer in pixel blocks, byte swapping the values if swab is set
+    CPLErr RB(int xblk, int yblk, buf_mgr src, void *buffer, bool swab = false);
+    // Unpack a page read from the data file into dst, which holds a full page
+    // When swab is false the byte swap is left to the caller
+    CPLErr UnpackPage(buf_mgr src, buf_mgr &dst, bool swab = true);
+    // Decode a page read from the data file, src is not modified
+    CPLErr DecodePage(int xblk, int yblk, buf_mgr src, void *buffer);
+    // Read a full page without using the block cache
+    CPLErr ReadPage(int xblk, int yblk, void *page);
+    // Compress a raw page, including the deflate step. On return dst holds the output
+    CPLErr CompressPage(buf_mgr &dst, buf_mgr &src);
+    // Compress a raw page after the predictor and the byte swap, without the deflate
+    CPLErr EncodePage(buf_mgr &dst, buf_mgr src);
 
     const char *GetOptionValue(const char *opt, const char *def);
     const ILImage *GetImage();
@@ -414,6 +651,10 @@ protected:
     GInt32 m_band;
     int deflate;
     int deflate_flags;
+    // Predictor for the raw page compressions, from the PREDICTOR option
+    ILPredictor predictor;
+    // Pages per side of a fetch from the caching source, from the FETCH_METATILE option
+    int metatile;
     // Level count of this band
     GInt32 m_l;
     // The info about the current image, to enable R-sets
@@ -439,6 +680,20 @@ protected:
     // Read the index record itself, can be overwritten
 //    virtual CPLErr ReadTileIdx(const ILSize &, ILIdx &, GIntBig bias = 0);
 
+    // Idle codec contexts, reused across pages.  There are as many as concurrent callers
+    // The derived band deletes the ones left in cpool and dpool
+    void *GetCodec(std::vector<void *> &pool);
+    void PutCodec(std::vector<void *> &pool, void *codec);
+    std::vector<void *> cpool;
+    std::vector<void *> dpool;
+    // ZPack and ZUnPack states for the deflate step, freed by this class
+    std::vector<void *> zcpool;
+    std::vector<void *> zdpool;
+    void *hCodecMutex;
+
+    // Deflates a page in place if there is room after it, see mrf_band.cpp
+    void *DeflateBlock(buf_mgr &src, size_t extrasize, int flags);
+
     GIntBig bandbit(int b) { return ((GIntBig)1) << b;}
     GIntBig bandbit() { return bandbit(m_band);}
     GIntBig AllBandMask() { return bandbit(poDS->nBands)-1;}
@@ -473,9 +728,12 @@ protected:
 
     CPLErr CompressPNG(buf_mgr &dst, buf_mgr &src);
     CPLErr DecompressPNG(buf_mgr &dst, buf_mgr &src);
+    unsigned char **RowPointers(std::vector<void *> &pool);
     void *PNGColors;
     void *PNGAlpha;
     int PalSize, TransSize;
+    // Encoder settings from PNG_PROFILE, -1 for the library default
+    int png_filters, png_level, png_strategy;
 };
 
 class JPEG_Band : public GDALMRFRasterBand {
@@ -483,10 +741,12 @@ class JPEG_Band : public GDALMRFRasterBand {
 public:
     JPEG_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level) : 
 	GDALMRFRasterBand(pDS,image,b,int(level)) {};
-    virtual ~JPEG_Band() {};
+    virtual ~JPEG_Band();
 protected:
     virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src);
     virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src);
+    // Decode a page at 1/scale of the page size, scale can be 1, 2, 4 or 8
+    CPLErr DecompressScaled(buf_mgr &dst, buf_mgr &src, int scale);
 };
 
 class Raw_Band : public GDALMRFRasterBand {
@@ -509,9 +769,39 @@ protected:
     virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src);
     virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src) ;
 
-    // Create options for TIF pages
-    char **papszOptions;
+    // Deflate level for TIF pages
+    int zlevel;
+};
+
+#if defined(ZSTD)
+class ZSTD_Band : public GDALMRFRasterBand {
+    friend class GDALMRFDataset;
+public:
+    ZSTD_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level);
+    virtual ~ZSTD_Band();
+protected:
+    virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src);
+    virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src);
+
+    // Compression level
+    int zlevel;
 };
+#endif
+
+#if defined(LZ4)
+class LZ4_Band : public GDALMRFRasterBand {
+    friend class GDALMRFDataset;
+public:
+    LZ4_Band(GDALMRFDataset *pDS, const ILImage &image, int b, int level);
+    virtual ~LZ4_Band();
+protected:
+    virtual CPLErr Decompress(buf_mgr &dst, buf_mgr &src);
+    virtual CPLErr Compress(buf_mgr &dst, buf_mgr &src);
+
+    // High compression encoder level, 0 for the fast encoder
+    int hclevel;
+};
+#endif
 
 #if defined(LERC)
 class LERC_Band : public GDALMRFRasterBand {
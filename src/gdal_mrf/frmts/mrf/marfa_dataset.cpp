@@ -41,6 +41,7 @@
 #include <assert.h>
 
 #include <vector>
+#include <algorithm>
 
 // Sleep is not portable and not covered in GDAL as far as I can tell
 // So we define MRF_sleep_ms, in milliseconds, not very accurate unfortunately
@@ -69,6 +70,22 @@ GDALMRFDataset::GDALMRFDataset()
     memcpy(GeoTransform, gt, sizeof(gt));
     bGeoTransformValid=FALSE;
     ifp.FP = dfp.FP = 0;
+    ifp.fd = dfp.fd = -1;
+    ifp.ready = dfp.ready = 0;
+    hMutex = NULL;
+    hFetchMutex = NULL;
+    idxmem = NULL;
+    idxmemsz = 0;
+    idxmemstate = 0;
+    wbuffer = NULL;
+    wbsize = wbused = 0;
+    wboffset = 0;
+    wbstate = 0;
+    lockfd = -1;
+    lockstate = 0;
+    clonemode = 0;
+    clonechunk = 0;
+    clonecopies = clonebytes = 0;
     pbuffer=0;
     pbsize=0;
     bdirty=0;
@@ -94,10 +111,30 @@ GDALMRFDataset::~GDALMRFDataset()
 {
     // Make sure everything gets written
     FlushCache();
+    if (0 != clonemode)
+	CPLDebug("MRF_IO", "Cloned index %s, %lld copies, %lld bytes copied\n",
+	    current.idxfname.c_str(), clonecopies, clonebytes);
+    GIntBig hits, grows;
+    bpool.GetStats(hits, grows);
+    if (0 != hits || 0 != grows)
+	CPLDebug("MRF", "Buffer pool %s, %lld reused, %lld allocated\n",
+	    fname.c_str(), hits, grows);
+    CPLFree(wbuffer);
     if (ifp.FP)
 	VSIFCloseL(ifp.FP);
     if (dfp.FP)
 	VSIFCloseL(dfp.FP);
+    if (1 == idxmemstate)
+	MMapClose(idxmem, size_t(idxmemsz));
+    else
+	CPLFree(idxmem);
+    PReadClose(ifp.fd);
+    PReadClose(dfp.fd);
+    PReadClose(lockfd);
+    if (hMutex)
+	CPLDestroyMutex(hMutex);
+    if (hFetchMutex)
+	CPLDestroyMutex(hFetchMutex);
     delete cds;
     delete poSrcDS;
     delete poColorTable;
@@ -154,7 +191,41 @@ CPLErr GDALMRFDataset::AdviseRead( int nXOff, int nYOff, int nXSize, int nYSize,
 {
     CPLDebug("MRF_IO", "AdviseRead %d, %d, %d, %d, bufsz %d,%d,%d\n",
 	nXOff, nYOff, nXSize, nYSize, nBufXSize, nBufYSize, nBandCount);
-    return CE_None;
+
+    if (nBufXSize <= 0 || nBufYSize <= 0 || nXSize <= 0 || nYSize <= 0 || !source.empty())
+	return CE_None;
+
+    vector<int> bands;
+    for (int i = 0; i < nBandCount; i++)
+	bands.push_back(panBandList ? panBandList[i] : i + 1);
+    if (bands.empty())
+	return CE_None;
+
+    // Pick the level the same way the read will, the coarsest one that is not too coarse
+    GDALRasterBand *b = GetRasterBand(bands[0]);
+    if (NULL == b)
+	return CE_None;
+    double factor = MIN(double(nXSize) / nBufXSize, double(nYSize) / nBufYSize);
+    int l = 0;
+    double lscale = 1;
+    for (int i = 0; i < b->GetOverviewCount(); i++) {
+	double s = double(nRasterXSize) / b->GetOverview(i)->GetXSize();
+	if (s > factor * 1.2)
+	    break;
+	l = i + 1;
+	lscale = s;
+    }
+
+    const ILImage &img = static_cast<GDALMRFRasterBand *>(l ? b->GetOverview(l - 1) : b)->img;
+    int bx0 = int(nXOff / lscale) / img.pagesize.x;
+    int by0 = int(nYOff / lscale) / img.pagesize.y;
+    int bx1 = int((nXOff + nXSize - 1) / lscale) / img.pagesize.x;
+    int by1 = int((nYOff + nYSize - 1) / lscale) / img.pagesize.y;
+
+    // Decoding in the block cache is optional, it can't be done in the background
+    // since the block cache is not thread safe
+    int decode = CSLFetchBoolean(papszOptions, "PRELOAD", CSLFetchBoolean(optlist, "ADVISE_PRELOAD", FALSE));
+    return PreloadTiles(l, bx0, by0, bx1, by1, int(bands.size()), &bands[0], !decode);
 }
 
 /*
@@ -174,6 +245,59 @@ CPLErr GDALMRFDataset::IRasterIO( GDALRWFlag eRWFlag, int nXOff, int nYOff, int
 	nXOff, nYOff, nXSize, nYSize, nBufXSize, nBufYSize, nBandCount, 
 	nPixelSpace, nLineSpace, nBandSpace);
 
+    int bx0 = nXOff / current.pagesize.x;
+    int by0 = nYOff / current.pagesize.y;
+    int bx1 = (nXOff + nXSize - 1) / current.pagesize.x;
+    int by1 = (nYOff + nYSize - 1) / current.pagesize.y;
+
+    //
+    // Full resolution reads covering multiple tiles get the tiles loaded in the block cache first,
+    // a few tile rows at a time, so the file reads can be merged
+    //
+    if (GF_Read == eRWFlag && nBufXSize == nXSize && nBufYSize == nYSize
+	&& source.empty() && (bx0 != bx1 || by0 != by1))
+    {
+	// How much a tile row takes in the block cache
+	GIntBig rowbytes = GIntBig(bx1 - bx0 + 1) * (current.pageSizeBytes / current.pagesize.c)
+	    * ((1 == current.pagesize.c) ? nBandCount : nBands);
+	// Use up to a quarter of the cache
+	int rows = int(MAX(GIntBig(1), GDALGetCacheMax64() / 4 / rowbytes));
+
+	for (int by = by0; by <= by1; by += rows) {
+	    int last = MIN(by1, by + rows - 1);
+	    PreloadTiles(0, bx0, by, bx1, last, nBandCount, panBandMap);
+
+	    // Then let the parent copy the lines covered by these tiles
+	    int y0 = MAX(nYOff, by * current.pagesize.y);
+	    int y1 = MIN(nYOff + nYSize, (last + 1) * current.pagesize.y);
+	    CPLErr ret = GDALPamDataset::IRasterIO(eRWFlag, nXOff, y0, nXSize, y1 - y0,
+		(char *)pData + GIntBig(y0 - nYOff) * nLineSpace, nXSize, y1 - y0,
+		eBufType, nBandCount, panBandMap, nPixelSpace, nLineSpace, nBandSpace);
+	    if (CE_None != ret)
+		return ret;
+	}
+	return CE_None;
+    }
+
+    //
+    // Reads decimated by 2, 4 or 8 from a read only JPEG MRF without overviews can decode
+    // the tiles directly at the reduced size.  In update mode the block cache might hold
+    // modified blocks which are not yet in the file, those have to go through the bands
+    //
+    GDALMRFRasterBand *b1 = static_cast<GDALMRFRasterBand *>(GetRasterBand(1));
+    if (GF_Read == eRWFlag && GA_ReadOnly == eAccess && IL_JPEG == current.comp && GDT_Byte == current.dt
+	&& source.empty() && !b1->deflate && 0 == b1->GetOverviewCount()
+	&& nBufXSize > 0 && nBufYSize > 0)
+    {
+	int scale = nXSize / nBufXSize;
+	if ((2 == scale || 4 == scale || 8 == scale)
+	    && nXSize == scale * nBufXSize && nYSize == scale * nBufYSize
+	    && 0 == nXOff % scale && 0 == nYOff % scale
+	    && 0 == current.pagesize.x % scale && 0 == current.pagesize.y % scale)
+	    return ReadReduced(nXOff, nYOff, nBufXSize, nBufYSize, scale, pData, eBufType,
+		nBandCount, panBandMap, nPixelSpace, nLineSpace, nBandSpace);
+    }
+
     //
     // Call the parent implementation, which splits it into bands and calls their IRasterIO
     // 
@@ -181,6 +305,252 @@ CPLErr GDALMRFDataset::IRasterIO( GDALRWFlag eRWFlag, int nXOff, int nYOff, int
 	eBufType, nBandCount, panBandMap, nPixelSpace, nLineSpace, nBandSpace);
 }
 
+/**
+*\brief Read a window decimated by scale, decoding the JPEG tiles at the reduced size
+*
+* The offsets and the page size are multiples of scale, the window is in the buffer resolution.
+* libjpeg does the reduction in the DCT domain, so the result is an average, not a subsample.
+* Empty tiles read as NoData.  The tiles are decoded in a pool buffer, the block cache is not used
+*/
+CPLErr GDALMRFDataset::ReadReduced(int nXOff, int nYOff, int nBufXSize, int nBufYSize, int scale,
+    void *pData, GDALDataType eBufType, int nBandCount, int *panBandMap,
+    int nPixelSpace, int nLineSpace, int nBandSpace)
+{
+    CPLDebug("MRF_IO", "ReadReduced %d, %d, %d, %d at 1/%d\n", nXOff, nYOff, nBufXSize, nBufYSize, scale);
+
+    JPEG_Band *b1 = static_cast<JPEG_Band *>(GetRasterBand(1));
+    const ILImage &img = b1->img;
+    int cstride = img.pagesize.c;
+    // Reduced page size and window origin
+    int rsz_x = img.pagesize.x / scale;
+    int rsz_y = img.pagesize.y / scale;
+    int x0 = nXOff / scale;
+    int y0 = nYOff / scale;
+    size_t rpsb = size_t(rsz_x) * rsz_y * cstride;
+
+    char *page = (char *)bpool.Acquire(rpsb);
+    if (NULL == page)
+	return CE_Failure;
+
+    CPLErr ret = CE_None;
+    for (int by = y0 / rsz_y; by <= (y0 + nBufYSize - 1) / rsz_y && CE_None == ret; by++) {
+	for (int bx = x0 / rsz_x; bx <= (x0 + nBufXSize - 1) / rsz_x && CE_None == ret; bx++) {
+	    for (int g = 0; g < img.pagecount.c && CE_None == ret; g++) {
+		// Skip the page groups which are not needed
+		int used = FALSE;
+		for (int i = 0; i < nBandCount; i++)
+		    if ((panBandMap[i] - 1) / cstride == g)
+			used = TRUE;
+		if (!used)
+		    continue;
+
+		ILIdx tinfo;
+		ret = ReadTileIdx(tinfo, ILSize(bx, by, 0, g, b1->m_l), img);
+		if (CE_None != ret)
+		    break;
+
+		int empty = (0 == tinfo.size);
+		if (!empty) {
+		    void *data = bpool.Acquire(static_cast<size_t>(tinfo.size));
+		    if (NULL == data) {
+			ret = CE_Failure;
+			break;
+		    }
+		    if (tinfo.size != GIntBig(ReadDataAt(data, tinfo.offset, static_cast<size_t>(tinfo.size)))) {
+			CPLError(CE_Failure, CPLE_AppDefined, "Unable to read data page, %ld@%lx",
+			    tinfo.size, tinfo.offset);
+			ret = CE_Failure;
+		    }
+		    else {
+			buf_mgr src = {(char *)data, static_cast<size_t>(tinfo.size)};
+			buf_mgr dst = {page, rpsb};
+			ret = static_cast<JPEG_Band *>(GetRasterBand(g * cstride + 1))->DecompressScaled(dst, src, scale);
+		    }
+		    bpool.Release(data);
+		    if (CE_None != ret)
+			break;
+		}
+
+		// The part of this page within the window
+		int tx0 = MAX(x0, bx * rsz_x);
+		int tx1 = MIN(x0 + nBufXSize, (bx + 1) * rsz_x);
+		int ty0 = MAX(y0, by * rsz_y);
+		int ty1 = MIN(y0 + nBufYSize, (by + 1) * rsz_y);
+
+		for (int i = 0; i < nBandCount; i++) {
+		    int c = panBandMap[i] - 1 - g * cstride;
+		    if (c < 0 || c >= cstride)
+			continue;
+		    char *out = (char *)pData + GIntBig(i) * nBandSpace
+			+ GIntBig(ty0 - y0) * nLineSpace + GIntBig(tx0 - x0) * nPixelSpace;
+		    int hasNoData = 0;
+		    double ndv = GetRasterBand(panBandMap[i])->GetNoDataValue(&hasNoData);
+		    if (!hasNoData)
+			ndv = 0.0;
+		    for (int y = ty0; y < ty1; y++, out += nLineSpace) {
+			if (empty)
+			    GDALCopyWords(&ndv, GDT_Float64, 0, out, eBufType, nPixelSpace, tx1 - tx0);
+			else
+			    GDALCopyWords(page + (size_t(y - by * rsz_y) * rsz_x + (tx0 - bx * rsz_x)) * cstride + c,
+				GDT_Byte, cstride, out, eBufType, nPixelSpace, tx1 - tx0);
+		    }
+		}
+	    }
+	}
+    }
+
+    bpool.Release(page);
+    return ret;
+}
+
+// A tile to be read, used to sort and merge reads
+typedef struct {
+    GIntBig offset;
+    GIntBig size;
+    int x, y;
+    GDALMRFRasterBand *band;
+} TileRead;
+
+static bool TileReadOrder(const TileRead &a, const TileRead &b) {
+    return a.offset < b.offset;
+}
+
+/**
+*\brief Read and decode a range of tiles in the block cache
+*
+* The block range is inclusive, at level l.  The index entries are read one tile row at a time,
+* then the tiles are sorted by their offset in the data file and close ones are read together.
+* Tiles already in the block cache and empty tiles are skipped.  Nothing is reported if something
+* goes wrong, those tiles are left for IReadBlock.
+* If bAdviseOnly is set, the merged ranges are only passed as hints to the OS, nothing is read
+*/
+CPLErr GDALMRFDataset::PreloadTiles(int l, int bx0, int by0, int bx1, int by1, int nBandCount, int *panBandMap,
+				    int bAdviseOnly)
+{
+    // Read through gaps smaller than this
+    const GIntBig MAX_GAP = 64 * 1024;
+    // Largest single read
+    const GIntBig MAX_READ = 16 * 1024 * 1024;
+
+    // Only for local data, and needs an index
+    if (!source.empty() || NULL == IdxFP() || NULL == DataFP())
+	return CE_None;
+
+    // Can only advise when the data file has a positional read handle
+    if (bAdviseOnly && dfp.fd < 0)
+	return CE_None;
+
+    // The bands to read, one per page at a given tile position
+    vector<GDALMRFRasterBand *> pbands;
+    for (int i = 0; i < nBandCount; i++) {
+	GDALRasterBand *b = GetRasterBand(panBandMap[i]);
+	if (b && l)
+	    b = b->GetOverview(l - 1);
+	if (NULL == b)
+	    return CE_None;
+	GDALMRFRasterBand *mb = static_cast<GDALMRFRasterBand *>(b);
+	int c = mb->m_band / mb->img.pagesize.c;
+	int dup = false;
+	for (size_t j = 0; j < pbands.size(); j++)
+	    dup |= (c == pbands[j]->m_band / mb->img.pagesize.c);
+	if (!dup)
+	    pbands.push_back(mb);
+    }
+
+    if (pbands.empty())
+	return CE_None;
+
+    const ILImage &img = pbands[0]->img;
+    bx1 = MIN(bx1, img.pagecount.x - 1);
+    by1 = MIN(by1, img.pagecount.y - 1);
+    if (bx0 < 0 || by0 < 0 || bx0 > bx1 || by0 > by1)
+	return CE_None;
+
+    // Index entries for one tile row, all pages within a tile are next to each other
+    int pc = img.pagecount.c;
+    vector<ILIdx> idx(size_t(bx1 - bx0 + 1) * pc);
+    size_t idxbytes = idx.size() * sizeof(ILIdx);
+
+    vector<TileRead> tiles;
+    for (int y = by0; y <= by1; y++) {
+	GIntBig start = IdxOffset(ILSize(bx0, y, 0, 0, l), img);
+	if (IdxInMemory()) {
+	    if (start + GIntBig(idxbytes) > idxmemsz)
+		return CE_None;
+	    memcpy(&idx[0], idxmem + start, idxbytes);
+	}
+	else if (idxbytes != ReadIdxAt(&idx[0], start, idxbytes))
+	    return CE_None;
+
+	for (int x = bx0; x <= bx1; x++)
+	    for (size_t i = 0; i < pbands.size(); i++) {
+		GDALMRFRasterBand *b = pbands[i];
+		ILIdx &ti = idx[size_t(x - bx0) * pc + b->m_band / img.pagesize.c];
+		TileRead t;
+		t.size = net64(ti.size);
+		t.offset = net64(ti.offset);
+		if (0 == t.size)
+		    continue;
+		GDALRasterBlock *poBlock = b->TryGetLockedBlockRef(x, y);
+		if (poBlock) {
+		    poBlock->DropLock();
+		    continue;
+		}
+		t.x = x;
+		t.y = y;
+		t.band = b;
+		tiles.push_back(t);
+	    }
+    }
+
+    std::sort(tiles.begin(), tiles.end(), TileReadOrder);
+
+    int nreads = 0;
+    for (size_t i = 0; i < tiles.size();) {
+	// Extend the read while the next tile is close enough
+	GIntBig start = tiles[i].offset;
+	GIntBig end = start + tiles[i].size;
+	size_t j = i + 1;
+	for (; j < tiles.size() && tiles[j].offset <= end + MAX_GAP; j++) {
+	    GIntBig tend = MAX(end, tiles[j].offset + tiles[j].size);
+	    if (tend - start > MAX_READ)
+		break;
+	    end = tend;
+	}
+
+	if (bAdviseOnly) {
+	    PReadAdvise(dfp.fd, start, end - start);
+	    nreads++;
+	    i = j;
+	    continue;
+	}
+
+	size_t sz = size_t(end - start);
+	char *buffer = (char *)bpool.Acquire(sz);
+	if (buffer && sz == ReadDataAt(buffer, start, sz)) {
+	    nreads++;
+	    for (size_t k = i; k < j; k++) {
+		TileRead &t = tiles[k];
+		GDALRasterBlock *poBlock = t.band->GetLockedBlockRef(t.x, t.y, TRUE);
+		if (NULL == poBlock)
+		    continue;
+		buf_mgr src = {buffer + (t.offset - start), size_t(t.size)};
+		CPLErr ret = t.band->DecodePage(t.x, t.y, src, poBlock->GetDataRef());
+		poBlock->DropLock();
+		// Drop it, IReadBlock will try again
+		if (CE_None != ret)
+		    t.band->FlushBlock(t.x, t.y, FALSE);
+	    }
+	}
+	bpool.Release(buffer);
+	i = j;
+    }
+
+    CPLDebug("MRF_IO", "%s %d tiles in %d reads\n", bAdviseOnly ? "Advised" : "Preloaded",
+	int(tiles.size()), nreads);
+    return CE_None;
+}
+
 
 /**
 *\brief Build some overviews
@@ -311,6 +681,21 @@ CPLErr GDALMRFDataset::IBuildOverviews(
 	    // Use "avg" flag to trigger the internal average sampling
 	    if (EQUAL("avg",pszResampling)) {
 
+		// Consecutive scale 2 levels are built together, reading the source only once
+		int nLevels = 1;
+		if (2.0 == scale && source.empty())
+		    while (i + nLevels < nOverviews && srclevel + nLevels < b->GetOverviewCount()
+			&& panOverviewList[i + nLevels] == (panOverviewList[i] << nLevels))
+			nLevels++;
+
+		if (nLevels > 1) {
+		    eErr = BuildPyramid(srclevel, nLevels);
+		    if (eErr == CE_Failure)
+			throw eErr;
+		    i += nLevels - 1;
+		    continue;
+		}
+
 		// Internal, using PatchOverview
 		if (srclevel >0)
 		    b = static_cast<GDALMRFRasterBand *>(b->GetOverview(srclevel-1));
@@ -836,9 +1221,21 @@ char      **GDALMRFDataset::GetFileList()
 }
 
 // Returns the dataset index file or null
+// Once open the handle doesn't change, so it is published with a flag, the atomic
+// read is a full barrier. Until then, only one thread at a time gets to open it
 VSILFILE *GDALMRFDataset::IdxFP() {
+    if (CPLAtomicAdd(&ifp.ready, 0))
+	return ifp.FP;
+    CPLMutexHolderD(&hMutex);
     if (ifp.FP != NULL)
 	return ifp.FP;
+    VSILFILE *fp = OpenIdxFP();
+    if (fp != NULL)
+	CPLAtomicInc(&ifp.ready);
+    return fp;
+}
+
+VSILFILE *GDALMRFDataset::OpenIdxFP() {
     char *mode = "rb";
     ifp.acc = GF_Read;
 
@@ -848,7 +1245,7 @@ VSILFILE *GDALMRFDataset::IdxFP() {
     }
     ifp.FP = VSIFOpenL(current.idxfname, mode);
 
-    int expected_size = idxSize;
+    GIntBig expected_size = idxSize;
     if (clonedSource) expected_size*=2;
 
     // Got it open or it doesn't need one
@@ -859,18 +1256,23 @@ VSILFILE *GDALMRFDataset::IdxFP() {
     // if (ifp.FP || current.comp == IL_NONE)
     if (NULL != ifp.FP) {
 
-	if (source.empty())
+	if (source.empty()) {
+	    if (GF_Read == ifp.acc)
+		ifp.fd = PReadOpen(current.idxfname);
 	    return ifp.FP;
+	}
 
 	// Make sure the index is large enough before proceeding
-	// Timeout in .1 seconds, can't really guarantee the accuracy
-	// So this is about half second, more than sufficient
-	int timeout = 5;
-	do {
+	// Local indices are created at full size, so this only waits for /vsi files or
+	// when the atomic creation didn't work.  The wait doubles from 1ms,
+	// about half second total, more than sufficient
+	for (int wait = 1; wait <= 256; wait *= 2) {
 	    if (CheckFileSize(current.idxfname, expected_size, GA_ReadOnly))
 		return ifp.FP;
-	    MRF_sleep_ms(100);
-	} while (--timeout);
+	    MRF_sleep_ms(wait);
+	}
+	if (CheckFileSize(current.idxfname, expected_size, GA_ReadOnly))
+	    return ifp.FP;
 
 	// If we get here it is a time-out
 	CPLError(CE_Failure, CPLE_AppDefined,
@@ -893,22 +1295,25 @@ VSILFILE *GDALMRFDataset::IdxFP() {
     if (NULL != ifp.FP)
 	return ifp.FP;
 
-    // Caching and index file absent, create it
-    // Due to a race, multiple processes might do this at the same time, but that is fine
-    ifp.FP = VSIFOpenL(current.idxfname,"wb");
-    if (NULL == ifp.FP) {
-	CPLError(CE_Failure,CPLE_AppDefined,"Can't create the MRF cache index file %s",
-	    current.idxfname.c_str());
-	return NULL;
-    }
-    VSIFCloseL(ifp.FP);
-    ifp.FP = NULL;
+    // Caching and index file absent, create it, large enough for caching and for cloning
+    // The atomic way means other processes don't have to wait for it to be extended
+    // Otherwise, due to a race, multiple processes might do this at the same time, but that is fine
+    // as long as none of them truncates it, another one might already be writing in it
+    if (!NewFileAtomic(current.idxfname, expected_size)) {
+	ifp.FP = VSIFOpenL(current.idxfname,"ab");
+	if (NULL == ifp.FP) {
+	    CPLError(CE_Failure,CPLE_AppDefined,"Can't create the MRF cache index file %s",
+		current.idxfname.c_str());
+	    return NULL;
+	}
+	VSIFCloseL(ifp.FP);
+	ifp.FP = NULL;
 
-    // Make it large enough for caching and for cloning
-    if (!CheckFileSize(current.idxfname, expected_size, GA_Update)) {
-	CPLError(CE_Failure,CPLE_AppDefined,"Can't extend the cache index file %s",
-	    current.idxfname.c_str());
-	return NULL;
+	if (!CheckFileSize(current.idxfname, expected_size, GA_Update)) {
+	    CPLError(CE_Failure,CPLE_AppDefined,"Can't extend the cache index file %s",
+		current.idxfname.c_str());
+	    return NULL;
+	}
     }
 
     // Try opening it again in rw mode so we can read and write into it
@@ -929,8 +1334,18 @@ VSILFILE *GDALMRFDataset::IdxFP() {
 // Data file is opened either in Read or Append mode, never in straight write
 //
 VSILFILE *GDALMRFDataset::DataFP() {
+    if (CPLAtomicAdd(&dfp.ready, 0))
+	return dfp.FP;
+    CPLMutexHolderD(&hMutex);
     if (dfp.FP != NULL)
 	return dfp.FP;
+    VSILFILE *fp = OpenDataFP();
+    if (fp != NULL)
+	CPLAtomicInc(&dfp.ready);
+    return fp;
+}
+
+VSILFILE *GDALMRFDataset::OpenDataFP() {
     char *mode = "rb";
     dfp.acc = GF_Read;
 
@@ -941,8 +1356,11 @@ VSILFILE *GDALMRFDataset::DataFP() {
     }
 
     dfp.FP = VSIFOpenL(current.datfname.c_str(), mode);
-    if (dfp.FP)
+    if (dfp.FP) {
+	if (GF_Read == dfp.acc)
+	    dfp.fd = PReadOpen(current.datfname);
 	return dfp.FP;
+    }
 
     // It could be a caching MRF
     if (source.empty()) {
@@ -966,6 +1384,65 @@ VSILFILE *GDALMRFDataset::DataFP() {
     return dfp.FP;
 };
 
+/**
+*\brief Read from the index or data file at a given offset, safe to call from multiple threads
+*
+* Uses the positional read handle when there is one, otherwise the seek and read
+* on the shared VSI file is done while holding the dataset lock
+*/
+size_t GDALMRFDataset::ReadAt(VF &f, void *buffer, GIntBig offset, size_t size)
+{
+    if (f.fd >= 0)
+	return PRead(f.fd, buffer, size, offset);
+    CPLMutexHolderD(&hMutex);
+    if (NULL == f.FP)
+	return 0;
+    VSIFSeekL(f.FP, offset, SEEK_SET);
+    return VSIFReadL(buffer, 1, size, f.FP);
+}
+
+size_t GDALMRFDataset::ReadIdxAt(void *buffer, GIntBig offset, size_t size)
+{
+    if (NULL == IdxFP())
+	return 0;
+    // Only datasets that buffer writes need the lock
+    if (1 != wbstate)
+	return ReadAt(ifp, buffer, offset, size);
+
+    // Index records not written yet are copied over the ones read from the file
+    CPLMutexHolderD(&hMutex);
+    size_t got = ReadAt(ifp, buffer, offset, size);
+    for (size_t i = 0; i < pending.size(); i++) {
+	GIntBig start = MAX(offset, pending[i].pos);
+	GIntBig end = MIN(offset + GIntBig(size), pending[i].pos + GIntBig(sizeof(ILIdx)));
+	if (start < end)
+	    memcpy((char *)buffer + (start - offset),
+		(char *)&pending[i].tinfo + (start - pending[i].pos), size_t(end - start));
+    }
+    return got;
+}
+
+size_t GDALMRFDataset::ReadDataAt(void *buffer, GIntBig offset, size_t size)
+{
+    if (NULL == DataFP())
+	return 0;
+    if (1 != wbstate)
+	return ReadAt(dfp, buffer, offset, size);
+
+    // Tiles still in the write buffer are copied from there.  The buffer is written
+    // only if the read needs some of it and some of the file
+    CPLMutexHolderD(&hMutex);
+    GIntBig wbend = wboffset + GIntBig(wbused);
+    if (wbused && offset >= wboffset && offset + GIntBig(size) <= wbend) {
+	memcpy(buffer, wbuffer + (offset - wboffset), size);
+	return size;
+    }
+    if (wbused && offset < wbend && offset + GIntBig(size) > wboffset
+	&& CE_None != FlushWrites())
+	return 0;
+    return ReadAt(dfp, buffer, offset, size);
+}
+
 /**
 * \Brief Populates the dataset variables from the XML definition file
 *
@@ -1224,6 +1701,9 @@ GDALDataset *GDALMRFDataset::CreateCopy(const char *pszFilename,
     pszValue = CSLFetchNameValue(papszOptions,"BLOCKYSIZE");
     if ( pszValue != NULL ) page.y = atoi( pszValue );
 
+    // Compression threads
+    int nThreads = ThreadCount(CSLFetchNameValue(papszOptions,"NUM_THREADS"));
+
     // Get the quality setting
     pszValue = CSLFetchNameValue(papszOptions,"QUALITY");    
     if ( pszValue != NULL )
@@ -1500,14 +1980,20 @@ GDALDataset *GDALMRFDataset::CreateCopy(const char *pszFilename,
     if (on(CSLFetchNameValue(papszOptions, "NOCOPY")))
 	return poDS;
 
-    // Need to flag the dataset as compressed (COMPRESSED=TRUE) to force block writes
-    // This might not be what we want, if the input and out order is truly separate
-    char **papszCWROptions = CSLDuplicate(0);
-    papszCWROptions = CSLAddNameValue(papszCWROptions, "COMPRESSED", "TRUE");
-    CPLErr err = GDALDatasetCopyWholeRaster( (GDALDatasetH) poSrcDS,
-	(GDALDatasetH) poDS, papszCWROptions, pfnProgress, pProgressData);
-
-    CSLDestroy(papszCWROptions);
+    CPLErr err;
+    // Compression can run in parallel
+    if (nThreads > 1 && (1 == page.c || nBands == page.c))
+	err = poDS->CopyParallel(poSrcDS, nThreads, pfnProgress, pProgressData);
+    else {
+	// Need to flag the dataset as compressed (COMPRESSED=TRUE) to force block writes
+	// This might not be what we want, if the input and out order is truly separate
+	char **papszCWROptions = CSLDuplicate(0);
+	papszCWROptions = CSLAddNameValue(papszCWROptions, "COMPRESSED", "TRUE");
+	err = GDALDatasetCopyWholeRaster( (GDALDatasetH) poSrcDS,
+	    (GDALDatasetH) poDS, papszCWROptions, pfnProgress, pProgressData);
+
+	CSLDestroy(papszCWROptions);
+    }
 
     if (CE_Failure==err) {
 	delete poDS;
@@ -1518,6 +2004,176 @@ GDALDataset *GDALMRFDataset::CreateCopy(const char *pszFilename,
     return poDS;
 }
 
+// One page worth of work for the parallel copy
+typedef struct {
+    GDALMRFRasterBand *band;
+    int x;	    // Tile column
+    int group;	    // Page within the tile position, for band separate pages
+    buf_mgr raw;    // The uncompressed page
+    buf_mgr out;    // The compressed page, if not empty
+    int empty;
+    CPLErr err;
+} CopyJob;
+
+// Shared by all the jobs of a batch of pages from a tile row
+typedef struct {
+    CopyJob *jobs;
+    char *swath;	// The batch from the source, pixel interleaved within each band group
+    GIntBig groupbytes;	// Size of a band group in the swath
+    int xoff;		// Swath start column in pixels
+    int width;		// Swath width in pixels
+    int rows;		// Valid rows in the swath
+    size_t outsize;	// Space available for each compressed page
+    const double *ndv;	// NoData for every band, 0 if not set
+} CopyRow;
+
+// Build one page from the swath and compress it
+static void CopyPageJob(void *arg, int i)
+{
+    CopyRow *row = (CopyRow *)arg;
+    CopyJob &job = row->jobs[i];
+    GDALMRFRasterBand *band = job.band;
+    const ILImage *img = band->GetImage();
+    int vsz = GDALGetDataTypeSize(img->dt) / 8;
+    int psz = vsz * img->pagesize.c;
+
+    int x0 = job.x * img->pagesize.x - row->xoff;
+    int cols = MIN(img->pagesize.x, row->width - x0);
+
+    // NoData of the bands in this page
+    const double *ndv = row->ndv + job.group * img->pagesize.c;
+
+    // Partial pages get filled with NoData first, each band with its own
+    if (cols != img->pagesize.x || row->rows != img->pagesize.y)
+	FillPixels(img->dt, job.raw.buffer, img->pageSizeBytes, ndv, img->pagesize.c);
+
+    char *src = row->swath + job.group * row->groupbytes + GIntBig(x0) * psz;
+    for (int y = 0; y < row->rows; y++)
+	memcpy(job.raw.buffer + GIntBig(y) * img->pagesize.x * psz,
+	    src + GIntBig(y) * row->width * psz, size_t(cols) * psz);
+
+    // Empty only if every band is all NoData
+    job.empty = isAllVal(img->dt, job.raw.buffer, img->pageSizeBytes, ndv, img->pagesize.c);
+    job.err = CE_None;
+    if (job.empty)
+	return;
+
+    buf_mgr src_page = job.raw;
+    job.out.size = row->outsize;
+    job.out.buffer = (char *)job.raw.buffer + img->pageSizeBytes;
+    job.err = band->CompressPage(job.out, src_page);
+}
+
+/**
+ *\brief Copy the base level of the source, with the compression done in parallel
+ *
+ * Each row of tiles is read from the source in batches of a few pages per thread, with
+ * one RasterIO per batch, then each page of the batch is built and compressed on one
+ * of nThreads threads.  The pages are written in order by the calling thread, through
+ * WriteTile.  The buffers come from the pool and depend on the thread count, not on the
+ * image width.  Works for pixel interleaved pages or for band separate pages
+ */
+CPLErr GDALMRFDataset::CopyParallel(GDALDataset *poSrc, int nThreads, 
+				    GDALProgressFunc pfnProgress, void *pProgressData)
+{
+    const ILImage &img = current;
+    int cstride = img.pagesize.c;
+    int groups = img.pagecount.c;
+    int vsz = GDALGetDataTypeSize(img.dt) / 8;
+
+    if (pfnProgress == NULL)
+	pfnProgress = GDALDummyProgress;
+
+    // Page columns per batch, enough to keep all the threads busy
+    int batch = MIN(img.pagecount.x, 4 * nThreads);
+
+    // Space for one batch of source data
+    GIntBig groupbytes = GIntBig(batch) * img.pagesize.x * img.pagesize.y * cstride * vsz;
+    char *swath = (char *)bpool.Acquire(size_t(groupbytes * groups));
+
+    // Each page needs space for the raw data followed by the compressed one
+    int njobs = batch * groups;
+    size_t jobsize = img.pageSizeBytes + pbsize;
+    char *jobspace = (char *)bpool.Acquire(jobsize * njobs);
+
+    if (NULL == swath || NULL == jobspace) {
+	bpool.Release(swath);
+	bpool.Release(jobspace);
+	CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate buffers for parallel copy");
+	return CE_Failure;
+    }
+
+    vector<CopyJob> jobs(njobs);
+    CopyRow row;
+    row.jobs = &jobs[0];
+    row.swath = swath;
+    row.groupbytes = groupbytes;
+    row.outsize = pbsize;
+
+    vector<double> ndv(nBands, 0.0);
+    for (int b = 0; b < nBands; b++) {
+	int success;
+	double val = GetRasterBand(b + 1)->GetNoDataValue(&success);
+	if (success) ndv[b] = val;
+    }
+    row.ndv = &ndv[0];
+
+    CPLErr ret = CE_None;
+    for (int y = 0; y < img.pagecount.y && CE_None == ret; y++) {
+	int y0 = y * img.pagesize.y;
+	row.rows = MIN(img.pagesize.y, img.size.y - y0);
+
+	for (int bx = 0; bx < img.pagecount.x && CE_None == ret; bx += batch) {
+	    int count = MIN(batch, img.pagecount.x - bx);
+	    row.xoff = bx * img.pagesize.x;
+	    row.width = MIN(count * img.pagesize.x, img.size.x - row.xoff);
+
+	    // Read all the bands, in band groups which match the pages
+	    ret = poSrc->RasterIO(GF_Read, row.xoff, y0, row.width, row.rows,
+		swath, row.width, row.rows, img.dt, nBands, NULL,
+		vsz * cstride, vsz * cstride * row.width,
+		(1 == cstride) ? int(groupbytes) : vsz);
+	    if (CE_None != ret)
+		break;
+
+	    for (int g = 0; g < groups; g++)
+		for (int x = 0; x < count; x++) {
+		    CopyJob &job = jobs[g * count + x];
+		    job.band = static_cast<GDALMRFRasterBand *>(GetRasterBand(g * cstride + 1));
+		    job.x = bx + x;
+		    job.group = g;
+		    job.raw.buffer = jobspace + jobsize * (g * count + x);
+		    job.raw.size = img.pageSizeBytes;
+		}
+
+	    RunParallel(nThreads, count * groups, CopyPageJob, &row);
+
+	    // Write them in order
+	    for (int x = 0; x < count && CE_None == ret; x++)
+		for (int g = 0; g < groups && CE_None == ret; g++) {
+		    CopyJob &job = jobs[g * count + x];
+		    ret = job.err;
+		    if (CE_None != ret)
+			break;
+		    GIntBig infooffset = IdxOffset(ILSize(job.x, y, 0, g, 0), job.band->img);
+		    if (job.empty)
+			ret = WriteTile(0, infooffset, 0);
+		    else
+			ret = WriteTile(job.out.buffer, infooffset, job.out.size);
+		}
+	}
+
+	if (CE_None == ret && !pfnProgress(double(y + 1) / img.pagecount.y, NULL, pProgressData)) {
+	    CPLError(CE_Failure, CPLE_UserInterrupt, "User terminated");
+	    ret = CE_Failure;
+	}
+    }
+
+    bpool.Release(swath);
+    bpool.Release(jobspace);
+    return ret;
+}
+
 /**
  *\Brief Create an MRF dataset, some settings can be changed later
  */
@@ -1558,6 +2214,10 @@ void GDALMRFDataset::FlushCache()
 
 {
     GDALDataset::FlushCache();
+    // FlushCache can't return an error, report it so it reaches the caller
+    if (CE_None != FlushWrites())
+	CPLError(CE_Failure, CPLE_FileIO, "MRF: Buffered writes to %s failed",
+	    current.datfname.c_str());
 
     if (!bNeedsFlush)
 	return;
@@ -1574,6 +2234,68 @@ void GDALMRFDataset::FlushCache()
     WriteConfig(config);
 }
 
+static bool PendingOrder(const ILIdxPending &a, const ILIdxPending &b) {
+    return a.pos < b.pos;
+}
+
+/**
+ *\brief Write the buffered tiles, then the index records
+ *
+ * The index records are sorted and adjacent ones are written together.
+ * If the same record was written more than once, the last one wins
+ */
+CPLErr GDALMRFDataset::FlushWrites()
+{
+    CPLMutexHolderD(&hMutex);
+    if (0 == wbused && pending.empty())
+	return CE_None;
+
+    VSILFILE *dfp = DataFP();
+    VSILFILE *ifp = IdxFP();
+    if (dfp == NULL || ifp == NULL) {
+	CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't open files to write buffered tiles");
+	wbused = 0;
+	pending.clear();
+	return CE_Failure;
+    }
+
+    if (wbused) {
+	VSIFSeekL(dfp, wboffset, SEEK_SET);
+	bool written = (wbused == VSIFWriteL(wbuffer, 1, wbused, dfp));
+	wbused = 0;
+	// The index records would point to tiles that are not in the file, drop them all
+	if (!written) {
+	    CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't write buffered tiles");
+	    pending.clear();
+	    return CE_Failure;
+	}
+    }
+
+    CPLErr ret = CE_None;
+
+    std::stable_sort(pending.begin(), pending.end(), PendingOrder);
+    vector<ILIdx> run;
+    for (size_t i = 0; i < pending.size(); i++) {
+	// Only the last record for a given location
+	if (i + 1 < pending.size() && pending[i + 1].pos == pending[i].pos)
+	    continue;
+	run.push_back(pending[i].tinfo);
+	// Write the run when the next one is not adjacent
+	GIntBig end = pending[i].pos + sizeof(ILIdx);
+	if (i + 1 == pending.size() || pending[i + 1].pos != end) {
+	    GIntBig start = end - GIntBig(run.size() * sizeof(ILIdx));
+	    VSIFSeekL(ifp, start, SEEK_SET);
+	    if (run.size() != VSIFWriteL(&run[0], sizeof(ILIdx), run.size(), ifp)) {
+		CPLError(CE_Failure, CPLE_FileIO, "MRF: Can't write index");
+		ret = CE_Failure;
+	    }
+	    run.clear();
+	}
+    }
+    pending.clear();
+    return ret;
+}
+
 // Copy the first index at the end of the file and bump the version count
 CPLErr GDALMRFDataset::AddVersion()
 {
@@ -1604,6 +2326,9 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
     CPLErr ret=CE_None;
     ILIdx tinfo={0,0};
 
+    // Writes use the shared file positions
+    CPLMutexHolderD(&hMutex);
+
     // These hide the dataset variables with the same name
     VSILFILE *dfp = DataFP();
     VSILFILE *ifp = IdxFP();
@@ -1614,6 +2339,48 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
     if (ifp == NULL || dfp == NULL)
 	return CE_Failure;
 
+    // Decide if writes are buffered, only for local, non-versioned MRFs
+    if (0 == wbstate) {
+	wbstate = -1;
+	int mb = atoi(CSLFetchNameValueDef(optlist, "WRITE_BUFFER", 
+	    CPLGetConfigOption("MRF_WRITE_BUFFER", "0")));
+	if (mb > 0 && GA_Update == eAccess && source.empty() && !hasVersions) {
+	    wbsize = size_t(mb) * 1024 * 1024;
+	    wbuffer = (char *)VSIMalloc(wbsize);
+	    if (wbuffer)
+		wbstate = 1;
+	    else
+		wbsize = 0;
+	}
+    }
+
+    if (1 == wbstate) {
+	// Make space if needed
+	if ((size && wbused + size > wbsize) || pending.size() >= wbsize / sizeof(ILIdx))
+	    ret = FlushWrites();
+
+	// Tiles which don't fit use the normal path
+	if (CE_None == ret && size <= wbsize) {
+	    if (size) {
+		if (0 == wbused) {
+		    VSIFSeekL(dfp, 0, SEEK_END);
+		    wboffset = VSIFTellL(dfp);
+		}
+		memcpy(wbuffer + wbused, buff, size_t(size));
+		tinfo.offset = net64(wboffset + wbused);
+		wbused += size_t(size);
+	    } else if (0 != buff) // Special empty tile, see below
+		tinfo.offset = net64(GUIntBig(buff));
+	    tinfo.size = net64(size);
+
+	    ILIdxPending p = {GIntBig(infooffset), tinfo};
+	    pending.push_back(p);
+	    return CE_None;
+	}
+	if (CE_None != ret)
+	    return ret;
+    }
+
     if (hasVersions) {
 	int new_version = false; // Assume no need to build new version
 	int new_tile = false;
@@ -1667,6 +2434,28 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
     // Convert to net format
     tinfo.size = net64(size);
 
+    // Caching MRFs can serialize the appends with a lock on the data file, shared by all
+    // the datasets filling the same cache, in this or other processes.  Each dataset has its
+    // own handle, so the lock also works between datasets of one process.
+    // The lock is only used if all of them set CACHE_LOCK, otherwise the writes get read back
+    if (0 == lockstate) {
+	lockstate = -1;
+	if (!source.empty() && CSLFetchBoolean(optlist, "CACHE_LOCK", FALSE)) {
+	    lockfd = LockOpen(current.datfname);
+	    if (lockfd >= 0)
+		lockstate = 1;
+	    else
+		CPLError(CE_Warning, CPLE_AppDefined,
+		    "MRF: Can't lock %s, verifying the writes instead", current.datfname.c_str());
+	}
+    }
+    bool locked = (0 != size && 1 == lockstate && FileLock(lockfd, true));
+    if (0 != size && 1 == lockstate && !locked) {
+	lockstate = -1;
+	CPLError(CE_Warning, CPLE_AppDefined,
+	    "MRF: Can't lock %s, verifying the writes instead", current.datfname.c_str());
+    }
+
     if (size) do {
 	// Theese statements are the critical MP section
 	VSIFSeekL(dfp, 0, SEEK_END);
@@ -1676,6 +2465,15 @@ CPLErr GDALMRFDataset::WriteTile(void *buff, GUIntBig infooffset, GUIntBig size)
 
 	tinfo.offset = net64(offset);
 	//
+	// Under the lock the tile is in the file before the next process gets the end
+	// offset, no need to read it back
+	//
+	if (locked) {
+	    VSIFFlushL(dfp);
+	    FileLock(lockfd, false);
+	    break;
+	}
+	//
 	// If caching, check that we can read it back, otherwise we're done
 	// This makes the caching MRF MP safe, without using locks
 	//
@@ -1758,6 +2556,74 @@ CPLErr GDALMRFDataset::GetGeoTransform( double *gt)
     return CE_None;
 }
 
+/**
+*\brief Hold the index in memory, if the IDX_MMAP option is set or force is true
+*
+* Only for read only MRFs which are not caching, since the index doesn't change.
+* The first call decides, force has no effect after that.
+* Local files get mapped, others are read in memory in one go
+* A private mapping still faults if another process truncates the index while
+* it is open, so IDX_MMAP is only safe for index files that are not rewritten
+*/
+int GDALMRFDataset::IdxInMemory(bool force)
+{
+    // idxmem is set before the state is published
+    int state = CPLAtomicAdd(&idxmemstate, 0);
+    if (0 != state)
+	return state > 0;
+
+    CPLMutexHolderD(&hMutex);
+    if (0 != idxmemstate)
+	return idxmemstate > 0;
+
+    state = LoadIdxMem(force);
+    CPLAtomicAdd(&idxmemstate, state);
+    return state > 0;
+}
+
+// Maps or reads the index, returns the new idxmemstate value.  Called with hMutex held
+int GDALMRFDataset::LoadIdxMem(bool force)
+{
+    if ((!force && !CSLFetchBoolean(optlist, "IDX_MMAP", CSLTestBoolean(CPLGetConfigOption("MRF_IDX_MMAP", "NO"))))
+	|| eAccess != GA_ReadOnly || !source.empty() || NULL == IdxFP())
+	return -1;
+
+    VSIStatBufL statb;
+    if (VSIStatL(current.idxfname, &statb) || statb.st_size <= 0)
+	return -1;
+
+    GIntBig sz = statb.st_size;
+    if (GIntBig(size_t(sz)) != sz)
+	return -1;
+
+    char *p = (char *)MMapOpen(ifp.fd, size_t(sz));
+    if (p != NULL) {
+	// Don't use the map if the file got shorter meanwhile, reading it would fault
+	if (VSIStatL(current.idxfname, &statb) == 0 && statb.st_size >= sz) {
+	    idxmem = p;
+	    idxmemsz = sz;
+	    return 1;
+	}
+	MMapClose(p, size_t(sz));
+	if (VSIStatL(current.idxfname, &statb) || statb.st_size <= 0)
+	    return -1;
+	sz = statb.st_size;
+    }
+
+    p = (char *)VSIMalloc(size_t(sz));
+    if (NULL == p)
+	return -1;
+    if (size_t(sz) != ReadAt(ifp, p, 0, size_t(sz))) {
+	CPLFree(p);
+	return -1;
+    }
+
+    CPLDebug("MRF_IO", "Index %s loaded in memory\n", current.idxfname.c_str());
+    idxmem = p;
+    idxmemsz = sz;
+    return 2;
+}
+
 /**
 *\brief Read a tile index
 *
@@ -1781,8 +2647,61 @@ CPLErr GDALMRFDataset::ReadTileIdx(ILIdx &tinfo, const ILSize &pos, const ILImag
 	return CE_Failure;
     }
 
-    VSIFSeekL(ifp, offset, SEEK_SET);
-    if (1 != VSIFReadL(&tinfo, sizeof(ILIdx), 1, ifp))
+    if (0 == bias && IdxInMemory()) {
+	if (offset < 0 || offset + GIntBig(sizeof(ILIdx)) > idxmemsz)
+	    return CE_Failure;
+	memcpy(&tinfo, idxmem + offset, sizeof(ILIdx));
+	tinfo.offset = net64(tinfo.offset);
+	tinfo.size   = net64(tinfo.size);
+	return CE_None;
+    }
+
+    // Cloned index mode and chunk size, set once.  The chunk is stored before the mode
+    // is published, so a thread which sees the mode also sees the chunk
+    int cmode = (0 != bias) ? CPLAtomicAdd(&clonemode, 0) : 0;
+    if (0 != bias && 0 == cmode) {
+	CPLMutexHolderD(&hMutex);
+	cmode = CPLAtomicAdd(&clonemode, 0);
+	if (0 == cmode) {
+	    const char *mode = CSLFetchNameValueDef(optlist, "CLONE_INDEX", "CHUNK");
+	    GIntBig chunk = atoi(CSLFetchNameValueDef(optlist, "CLONE_CHUNK", "32768"));
+	    // Multiple of the record size, to have full index entries
+	    clonechunk = MAX(chunk / GIntBig(sizeof(ILIdx)), 1) * sizeof(ILIdx);
+	    if (EQUAL(mode, "BULK"))
+		cmode = CLONE_BULK;
+	    else if (EQUAL(mode, "LAZY")) {
+		cmode = CLONE_LAZY;
+		// The source index is read for every cloned record, hold it in memory
+		GDALMRFDataset *pSrc = static_cast<GDALMRFDataset *>(GetSrcDS());
+		if (NULL != pSrc)
+		    pSrc->IdxInMemory(true);
+	    }
+	    else {
+		if (!EQUAL(mode, "CHUNK"))
+		    CPLError(CE_Warning, CPLE_AppDefined,
+			"MRF: Unknown CLONE_INDEX %s, using CHUNK", mode);
+		cmode = CLONE_CHUNK;
+	    }
+	    CPLAtomicAdd(&clonemode, cmode);
+	}
+    }
+
+    // Lazy cloning reads the source index directly, the local copy is never filled
+    if (0 != bias && CLONE_LAZY == cmode) {
+	GDALMRFDataset *pSrc = static_cast<GDALMRFDataset *>(GetSrcDS());
+	if (NULL == pSrc)
+	    return CE_Failure;
+	if (CE_None != pSrc->ReadTileIdx(tinfo, pos, img)) {
+	    CPLError( CE_Failure, CPLE_FileIO, "Can't read cloned source index");
+	    return CE_Failure;
+	}
+	// Same as a copied empty record
+	if (0 == tinfo.offset && 0 == tinfo.size)
+	    tinfo.offset = 1;
+	return CE_None;
+    }
+
+    if (sizeof(ILIdx) != ReadIdxAt(&tinfo, offset, sizeof(ILIdx)))
 	return CE_Failure;
     // Convert them to native form
     tinfo.offset = net64(tinfo.offset);
@@ -1793,52 +2712,54 @@ CPLErr GDALMRFDataset::ReadTileIdx(ILIdx &tinfo, const ILSize &pos, const ILImag
 
     // zero size and zero offset in sourced index means that this portion is un-initialized
 
+    // Copying the source index section is done by one thread at a time
+    CPLMutexHolderD(&hMutex);
+
     // Should be cloned and the offset within the cloned index
     offset -= bias;
     assert(offset < bias);
     assert(clonedSource);
 
-
-    // Read this block from the remote index, prepare it and store it in the right place
-    // The block size in bytes, should be a multiple of 16, to have full index entries
-    const int CPYSZ = 32768;
-    // Adjust offset to the start of the block
-    offset = ( offset / CPYSZ ) * CPYSZ;
-    GIntBig size = MIN(size_t(CPYSZ), size_t(bias - offset));
-    size /= sizeof(ILIdx); // In records
-    vector<ILIdx> buf(size);
-    ILIdx *buffer = &buf[0]; // Buffer to copy the source to the clone index
-
+    // Read the source index, prepare it and store it in the right place
+    // The chunk holding this record, or all of it in one sequential pass for BULK
+    GIntBig start = 0, end = bias;
+    if (CLONE_CHUNK == cmode) {
+	start = (offset / clonechunk) * clonechunk;
+	end = MIN(start + clonechunk, bias);
+    }
 
     // Fetch the data from the cloned index
     GDALMRFDataset *pSrc = static_cast<GDALMRFDataset *>(GetSrcDS());
 
-    VSILFILE *srcidx = pSrc->IdxFP();
-    if (!srcidx) {
+    if (NULL == pSrc || !pSrc->IdxFP()) {
 	CPLError( CE_Failure, CPLE_FileIO, "Can't open cloned source index");
 	return CE_Failure; // Source reported the error
     }
 
-    VSIFSeekL(srcidx, offset, SEEK_SET);
-    size = VSIFReadL(buffer, sizeof(ILIdx), size, srcidx);
-    if (size != buf.size()) {
-	CPLError( CE_Failure, CPLE_FileIO, "Can't read cloned source index");
-	return CE_Failure; // Source reported the error
-    }
+    // Copy in blocks of up to 1MB
+    vector<ILIdx> buf(size_t(MIN(end - start, GIntBig(1024 * 1024)) / sizeof(ILIdx)));
+    for (GIntBig at = start; at < end; ) {
+	size_t size = size_t(MIN(end - at, GIntBig(buf.size() * sizeof(ILIdx)))) / sizeof(ILIdx);
+	if (size != pSrc->ReadIdxAt(&buf[0], at, size * sizeof(ILIdx)) / sizeof(ILIdx)) {
+	    CPLError( CE_Failure, CPLE_FileIO, "Can't read cloned source index");
+	    return CE_Failure; // Source reported the error
+	}
 
-    // Mark the empty records as checked, by making the offset non-zero
-    for (vector<ILIdx>::iterator it = buf.begin(); it != buf.end(); it++) {
-	if (it->offset == 0 && it->size == 0)
-	    it->offset = net64(1);
-    }
+	// Mark the empty records as checked, by making the offset non-zero
+	for (size_t i = 0; i < size; i++)
+	    if (buf[i].offset == 0 && buf[i].size == 0)
+		buf[i].offset = net64(1);
 
-    // Write it in the right place in the local index file
-    VSIFSeekL(ifp, bias + offset, SEEK_SET);
-    size = VSIFWriteL(&buf[0], sizeof(ILIdx), size, ifp);
-    if (size != buf.size()) {
-	CPLError( CE_Failure, CPLE_FileIO, "Can't write to cloning MRF index");
-	return CE_Failure; // Source reported the error
+	// Write it in the right place in the local index file
+	VSIFSeekL(ifp, bias + at, SEEK_SET);
+	if (size != VSIFWriteL(&buf[0], sizeof(ILIdx), size, ifp)) {
+	    CPLError( CE_Failure, CPLE_FileIO, "Can't write to cloning MRF index");
+	    return CE_Failure; // Source reported the error
+	}
+	at += size * sizeof(ILIdx);
+	clonebytes += size * sizeof(ILIdx);
     }
+    clonecopies++;
 
     // Cloned index updated, restart this function, it will work now
     return ReadTileIdx(tinfo, pos, img, bias);
@@ -47,51 +47,103 @@
 #include <assert.h>
 #include "../zlib/zlib.h"
 
+#if defined(MRF_USE_SSE2)
+#include <emmintrin.h>
+#endif
+
 using std::vector;
 using std::string;
 
-// packs a block of a given type, with a stride
-// Count is the number of items that need to be copied
-// These are separate to allow for optimization
-
-template <typename T> void cpy_stride_in(void *dst, 
-	const void *src, int c, int stride)
+#if defined(MRF_USE_SSE2)
+// A vector holding the value repeated
+template<typename T> static inline __m128i vsplat(T val)
 {
-    T *s=(T *)src;
-    T *d=(T *)dst;
+    T v[16 / sizeof(T)];
+    for (size_t i = 0; i < 16 / sizeof(T); i++)
+	v[i] = val;
+    return _mm_loadu_si128((__m128i *)v);
+}
+#endif
 
-    while (c--) {
-	*d++=*s;
-	s+=stride;
+// Does every value in the buffer have the same value, using strict comparison
+// The vector loop compares the bytes, 64 at a time, and exits at the first block that differs
+template<typename T> inline int isAllVal(const T *b, size_t bytecount, double ndv)
+
+{
+    T val = (T)(ndv);
+    size_t count = bytecount / sizeof(T);
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    const __m128i v = vsplat(val);
+    for (; i + 64 / sizeof(T) <= count; i += 64 / sizeof(T)) {
+	const __m128i *p = (const __m128i *)(b + i);
+	__m128i m = _mm_and_si128(
+	    _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), v), _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), v)),
+	    _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), v), _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), v)));
+	if (0xffff != _mm_movemask_epi8(m))
+	    return FALSE;
     }
+#endif
+    for (; i < count; i++)
+	if (b[i] != val)
+	    return FALSE;
+    return TRUE;
 }
 
-template <typename T> void cpy_stride_out(void *dst, 
-	const void *src, int c, int stride)
+// Floating point compares values, so 0 matches -0, and a NaN NoData matches any NaN
+template<> inline int isAllVal<float>(const float *b, size_t bytecount, double ndv)
 {
-    T *s=(T *)src;
-    T *d=(T *)dst;
-
-    while (c--) {
-	*d=*s++;
-	d+=stride;
+    float val = float(ndv);
+    int nanval = CPLIsNan(ndv);
+    size_t count = bytecount / sizeof(float);
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    const __m128 v = _mm_set1_ps(val);
+    for (; i + 16 <= count; i += 16) {
+	__m128 x0 = _mm_loadu_ps(b + i), x1 = _mm_loadu_ps(b + i + 4);
+	__m128 x2 = _mm_loadu_ps(b + i + 8), x3 = _mm_loadu_ps(b + i + 12);
+	__m128 m = nanval ?
+	    _mm_and_ps(_mm_and_ps(_mm_cmpunord_ps(x0, x0), _mm_cmpunord_ps(x1, x1)),
+		_mm_and_ps(_mm_cmpunord_ps(x2, x2), _mm_cmpunord_ps(x3, x3))) :
+	    _mm_and_ps(_mm_and_ps(_mm_cmpeq_ps(x0, v), _mm_cmpeq_ps(x1, v)),
+		_mm_and_ps(_mm_cmpeq_ps(x2, v), _mm_cmpeq_ps(x3, v)));
+	if (0xf != _mm_movemask_ps(m))
+	    return FALSE;
     }
+#endif
+    for (; i < count; i++)
+	if (nanval ? !CPLIsNan(b[i]) : b[i] != val)
+	    return FALSE;
+    return TRUE;
 }
 
-// Does every value in the buffer have the same value, using strict comparison
-template<typename T> inline int isAllVal(const T *b, size_t bytecount, double ndv)
-
+template<> inline int isAllVal<double>(const double *b, size_t bytecount, double ndv)
 {
-    T val = (T)(ndv);
-    size_t count = bytecount / sizeof(T);
-    while (count--)
-	if (*(b++) != val)
+    int nanval = CPLIsNan(ndv);
+    size_t count = bytecount / sizeof(double);
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    const __m128d v = _mm_set1_pd(ndv);
+    for (; i + 8 <= count; i += 8) {
+	__m128d x0 = _mm_loadu_pd(b + i), x1 = _mm_loadu_pd(b + i + 2);
+	__m128d x2 = _mm_loadu_pd(b + i + 4), x3 = _mm_loadu_pd(b + i + 6);
+	__m128d m = nanval ?
+	    _mm_and_pd(_mm_and_pd(_mm_cmpunord_pd(x0, x0), _mm_cmpunord_pd(x1, x1)),
+		_mm_and_pd(_mm_cmpunord_pd(x2, x2), _mm_cmpunord_pd(x3, x3))) :
+	    _mm_and_pd(_mm_and_pd(_mm_cmpeq_pd(x0, v), _mm_cmpeq_pd(x1, v)),
+		_mm_and_pd(_mm_cmpeq_pd(x2, v), _mm_cmpeq_pd(x3, v)));
+	if (0x3 != _mm_movemask_pd(m))
+	    return FALSE;
+    }
+#endif
+    for (; i < count; i++)
+	if (nanval ? !CPLIsNan(b[i]) : b[i] != ndv)
 	    return FALSE;
     return TRUE;
 }
 
 // Dispatcher based on gdal data type
-static int isAllVal(GDALDataType gt, void *b, size_t bytecount, double ndv)
+int isAllVal(GDALDataType gt, void *b, size_t bytecount, double ndv)
 {
     // Test to see if it has data
     int isempty = false;
@@ -117,28 +169,234 @@ static int isAllVal(GDALDataType gt, void *b, size_t bytecount, double ndv)
     return isempty;
 }
 
+// Interleaved, band c of every pixel is compared with its own ndv[c]
+template<typename T> static int isAllValPixel(const T *b, size_t bytecount, const double *ndv, int cstride)
+{
+    size_t count = bytecount / sizeof(T);
+    for (int c = 0; c < cstride; c++) {
+	T val = T(ndv[c]);
+	int nanval = CPLIsNan(ndv[c]);
+	for (size_t i = c; i < count; i += cstride)
+	    if (nanval ? !CPLIsNan(double(b[i])) : b[i] != val)
+		return FALSE;
+    }
+    return TRUE;
+}
+
+int isAllVal(GDALDataType gt, void *b, size_t bytecount, const double *ndv, int cstride)
+{
+    // Use the vector version when all the bands have the same NoData
+    int c = 1;
+    while (c < cstride && (ndv[c] == ndv[0] || (CPLIsNan(ndv[c]) && CPLIsNan(ndv[0]))))
+	c++;
+    if (c == cstride)
+	return isAllVal(gt, b, bytecount, ndv[0]);
+
+    int isempty = false;
+#define TEST_T(GType, type)\
+    case GType: \
+	isempty = isAllValPixel((type *)b, bytecount, ndv, cstride);\
+	break
+
+    switch (gt) {
+	TEST_T(GDT_Byte, GByte);
+	TEST_T(GDT_UInt16, GUInt16);
+	TEST_T(GDT_Int16, GInt16);
+	TEST_T(GDT_UInt32, GUInt32);
+	TEST_T(GDT_Int32, GInt32);
+	TEST_T(GDT_Float32, float);
+	TEST_T(GDT_Float64, double);
+	default : break;
+    }
+#undef TEST_T
+
+    return isempty;
+}
+
+// Fills an interleaved buffer, band c of every pixel with ndv[c]
+void FillPixels(GDALDataType gt, void *b, size_t bytecount, const double *ndv, int cstride)
+{
+    char *buffer = static_cast<char *>(b);
+    size_t psz = size_t(GDALGetDataTypeSize(gt) / 8) * cstride;
+    if (0 == psz || bytecount < psz)
+	return;
+
+    // Build the first pixel, with the same conversion as FillBlock
+    for (int c = 0; c < cstride; c++) {
+	char *p = buffer + c * (psz / cstride);
+#define SET_T(GType, type)\
+	case GType: { type v = type(ndv[c]); memcpy(p, &v, sizeof(type)); } break
+
+	switch (gt) {
+	    SET_T(GDT_Byte, GByte);
+	    SET_T(GDT_UInt16, GUInt16);
+	    SET_T(GDT_Int16, GInt16);
+	    SET_T(GDT_UInt32, GUInt32);
+	    SET_T(GDT_Int32, GInt32);
+	    SET_T(GDT_Float32, float);
+	    SET_T(GDT_Float64, double);
+	    default : break;
+	}
+#undef SET_T
+    }
+
+    // Then copy it over, doubling the filled span every time
+    size_t done = psz;
+    bytecount -= bytecount % psz;
+    while (done < bytecount) {
+	size_t n = MIN(done, bytecount - done);
+	memcpy(buffer + done, buffer, n);
+	done += n;
+    }
+}
+
 // Swap bytes in place, unconditional
 static void swab_buff(buf_mgr &src, const ILImage &img)
 {
-    switch (GDALGetDataTypeSize(img.dt)) {
-    case 16: {
-	short int *b=(short int*)src.buffer;
-	for (int i=src.size/2;i;b++,i--) 
-	    *b=swab16(*b);
-	break;
-	     }
-    case 32: {
-	int *b=(int*)src.buffer;
-	for (int i=src.size/4;i;b++,i--) 
-	    *b=swab32(*b);
-	break;
-	     }
-    case 64: {
-	long long *b=(long long*)src.buffer;
-	for (int i=src.size/8;i;b++,i--)
-	    *b=swab64(*b);
-	break;
-	     }
+    int sz = GDALGetDataTypeSize(img.dt) / 8;
+    swab_values(src.buffer, src.size / sz, sz);
+}
+
+/**
+*\brief Byte shuffle, byte b of every element goes in plane b
+*
+*  count elements of sz bytes, from src to dst.  Same as deinterleaving sz byte bands
+*/
+void shuffle(char *dst, const char *src, size_t count, int sz)
+{
+    char *planes[16];
+    for (int b = 0; b < sz; b++)
+	planes[b] = dst + b * count;
+    deinterleave(planes, src, count, sz, 1);
+}
+
+// The reverse of shuffle
+void unshuffle(char *dst, const char *src, size_t count, int sz)
+{
+    char *planes[16];
+    for (int b = 0; b < sz; b++)
+	planes[b] = (char *)src + b * count;
+    interleave(dst, planes, count, sz, 1);
+}
+
+#if defined(MRF_USE_SSE2)
+// Per element size vector operations for the delta predictor, the last argument picks the size
+static inline __m128i vsub(__m128i a, __m128i b, GByte) { return _mm_sub_epi8(a, b); }
+static inline __m128i vsub(__m128i a, __m128i b, GUInt16) { return _mm_sub_epi16(a, b); }
+static inline __m128i vsub(__m128i a, __m128i b, GUInt32) { return _mm_sub_epi32(a, b); }
+static inline __m128i vsub(__m128i a, __m128i b, GUIntBig) { return _mm_sub_epi64(a, b); }
+
+static inline __m128i vadd(__m128i a, __m128i b, GByte) { return _mm_add_epi8(a, b); }
+static inline __m128i vadd(__m128i a, __m128i b, GUInt16) { return _mm_add_epi16(a, b); }
+static inline __m128i vadd(__m128i a, __m128i b, GUInt32) { return _mm_add_epi32(a, b); }
+static inline __m128i vadd(__m128i a, __m128i b, GUIntBig) { return _mm_add_epi64(a, b); }
+
+// Running sum of the vector elements
+static inline __m128i vscan(__m128i x, GByte) {
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+}
+static inline __m128i vscan(__m128i x, GUInt16) {
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi16(x, _mm_slli_si128(x, 8));
+}
+static inline __m128i vscan(__m128i x, GUInt32) {
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+}
+static inline __m128i vscan(__m128i x, GUIntBig) {
+    return _mm_add_epi64(x, _mm_slli_si128(x, 8));
+}
+
+// Last element, in all the vector elements
+static inline __m128i vlast(__m128i x, GByte) {
+    x = _mm_srli_si128(x, 15);
+    x = _mm_unpacklo_epi8(x, x);
+    x = _mm_unpacklo_epi16(x, x);
+    return _mm_shuffle_epi32(x, 0);
+}
+static inline __m128i vlast(__m128i x, GUInt16) {
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xff), 0xff);
+}
+static inline __m128i vlast(__m128i x, GUInt32) { return _mm_shuffle_epi32(x, 0xff); }
+static inline __m128i vlast(__m128i x, GUIntBig) { return _mm_unpackhi_epi64(x, x); }
+#endif
+
+/**
+*\brief Horizontal differencing, each value is replaced by the difference from the previous one
+*
+*  Works on unsigned integers, the modulo arithmetic makes it reversible for any type.
+*  c is the distance between neighbours, the band count for interleaved pages
+*/
+template<typename T> static void delta(T *dst, const T *src, int rows, int rowlen, int c)
+{
+    for (int r = 0; r < rows; r++, dst += rowlen, src += rowlen) {
+	int i = 0;
+	for (; i < c; i++)
+	    dst[i] = src[i];
+#if defined(MRF_USE_SSE2)
+	for (; i + int(16 / sizeof(T)) <= rowlen; i += 16 / sizeof(T))
+	    _mm_storeu_si128((__m128i *)(dst + i), vsub(_mm_loadu_si128((const __m128i *)(src + i)),
+		_mm_loadu_si128((const __m128i *)(src + i - c)), T()));
+#endif
+	for (; i < rowlen; i++)
+	    dst[i] = T(src[i] - src[i - c]);
+    }
+}
+
+// The reverse of delta, in place. Only the c == 1 case is vectorized
+template<typename T> static void undelta(T *p, int rows, int rowlen, int c)
+{
+    for (int r = 0; r < rows; r++, p += rowlen) {
+	int i = c;
+#if defined(MRF_USE_SSE2)
+	if (1 == c) {
+	    __m128i carry = _mm_setzero_si128();
+	    for (i = 0; i + int(16 / sizeof(T)) <= rowlen; i += 16 / sizeof(T)) {
+		__m128i x = vadd(vscan(_mm_loadu_si128((__m128i *)(p + i)), T()), carry, T());
+		_mm_storeu_si128((__m128i *)(p + i), x);
+		carry = vlast(x, T());
+	    }
+	    i = MAX(i, 1);
+	}
+#endif
+	for (; i < rowlen; i++)
+	    p[i] = T(p[i] + p[i - c]);
+    }
+}
+
+// Apply the delta predictor to a page, wider types use 64 bit parts
+void delta_buff(buf_mgr &dst, const buf_mgr &src, const ILImage &img)
+{
+    int sz = GDALGetDataTypeSize(img.dt) / 8;
+    int k = MAX(sz / 8, 1);
+    int rows = img.pagesize.y;
+    int rowlen = img.pagesize.x * img.pagesize.c * k;
+    int c = img.pagesize.c * k;
+    switch (sz) {
+    case 1: delta((GByte *)dst.buffer, (const GByte *)src.buffer, rows, rowlen, c); break;
+    case 2: delta((GUInt16 *)dst.buffer, (const GUInt16 *)src.buffer, rows, rowlen, c); break;
+    case 4: delta((GUInt32 *)dst.buffer, (const GUInt32 *)src.buffer, rows, rowlen, c); break;
+    default: delta((GUIntBig *)dst.buffer, (const GUIntBig *)src.buffer, rows, rowlen, c); break;
+    }
+}
+
+// Undo the delta predictor, in place
+void undelta_buff(buf_mgr &src, const ILImage &img)
+{
+    int sz = GDALGetDataTypeSize(img.dt) / 8;
+    int k = MAX(sz / 8, 1);
+    int rows = img.pagesize.y;
+    int rowlen = img.pagesize.x * img.pagesize.c * k;
+    int c = img.pagesize.c * k;
+    switch (sz) {
+    case 1: undelta((GByte *)src.buffer, rows, rowlen, c); break;
+    case 2: undelta((GUInt16 *)src.buffer, rows, rowlen, c); break;
+    case 4: undelta((GUInt32 *)src.buffer, rows, rowlen, c); break;
+    default: undelta((GUIntBig *)src.buffer, rows, rowlen, c); break;
     }
 }
 
@@ -147,7 +405,7 @@ static void swab_buff(buf_mgr &src, const ILImage &img)
 *  If the output fits past the data, it uses that area
 * otherwise it uses a temporary buffer and copies the data over the input on return, returning a pointer to it
 */
-static void *DeflateBlock(buf_mgr &src, size_t extrasize, int flags) {
+void *GDALMRFRasterBand::DeflateBlock(buf_mgr &src, size_t extrasize, int flags) {
     // The one we might need to allocate
     void *dbuff = NULL;
     buf_mgr dst;
@@ -166,7 +424,12 @@ static void *DeflateBlock(buf_mgr &src, size_t extrasize, int flags) {
 	    return NULL;
     }
 
-    if (!ZPack(src, dst, flags)) {
+    // The deflate state is reused from page to page
+    void *state = GetCodec(zcpool);
+    int ok = ZPack(src, dst, flags, &state);
+    if (state)
+	PutCodec(zcpool, state);
+    if (!ok) {
 	CPLFree(dbuff); // Safe to call with NULL
 	return NULL;
     }
@@ -187,6 +450,7 @@ GDALMRFRasterBand::GDALMRFRasterBand(GDALMRFDataset *parent_dataset,
 					const ILImage &image, int band, int ov)
 {
     poDS=parent_dataset;
+    hCodecMutex=NULL;
     nBand=band;
     m_band=band-1;
     m_l=ov;
@@ -221,6 +485,34 @@ GDALMRFRasterBand::GDALMRFRasterBand(GDALMRFDataset *parent_dataset,
 	    zv = Z_FIXED;
 	deflate_flags |= (zv << 6);
     }
+
+    // The predictors only make sense for the compressions that store the raw page
+    predictor = IL_NOPRED;
+    const char *pred = CSLFetchNameValueDef(poDS->optlist, "PREDICTOR", NULL);
+    if (pred && (IL_NONE == img.comp || IL_ZLIB == img.comp
+#if defined(ZSTD)
+	|| IL_ZSTD == img.comp
+#endif
+#if defined(LZ4)
+	|| IL_LZ4 == img.comp
+#endif
+	)) {
+	if (EQUAL(pred, "DELTA"))
+	    predictor = IL_DELTA;
+	// Shuffling single bytes doesn't change anything
+	else if (EQUAL(pred, "SHUFFLE") && GDALGetDataTypeSize(img.dt) > 8)
+	    predictor = IL_SHUFFLE;
+	else if (!EQUAL(pred, "SHUFFLE") && !EQUAL(pred, "NONE"))
+	    CPLError(CE_Warning, CPLE_AppDefined, "MRF: Unknown predictor %s, ignored", pred);
+    }
+
+    // Caching MRFs fetch up to N x N pages with a single source read, 1 to 8
+    metatile = atoi(CSLFetchNameValueDef(poDS->optlist, "FETCH_METATILE", "1"));
+    metatile = MIN(MAX(metatile, 1), 8);
+    // The meta-tile buffer comes from the dataset pool, which doesn't shrink, keep it small
+    const double maxbytes = 64.0 * 1024 * 1024;
+    while (metatile > 1 && double(metatile) * metatile * img.pageSizeBytes > maxbytes)
+	metatile--;
 }
 
 // Clean up the overviews if they exist
@@ -230,6 +522,29 @@ GDALMRFRasterBand::~GDALMRFRasterBand()
 	delete overviews[overviews.size()-1];
 	overviews.pop_back();
     };
+    for (size_t i = 0; i < zcpool.size(); i++)
+	ZFreeState(zcpool[i], true);
+    for (size_t i = 0; i < zdpool.size(); i++)
+	ZFreeState(zdpool[i], false);
+    if (hCodecMutex)
+	CPLDestroyMutex(hCodecMutex);
+}
+
+// Takes an idle codec from a pool, NULL if there is none
+void *GDALMRFRasterBand::GetCodec(std::vector<void *> &pool)
+{
+    CPLMutexHolderD(&hCodecMutex);
+    if (pool.empty())
+	return NULL;
+    void *codec = pool.back();
+    pool.pop_back();
+    return codec;
+}
+
+void GDALMRFRasterBand::PutCodec(std::vector<void *> &pool, void *codec)
+{
+    CPLMutexHolderD(&hCodecMutex);
+    pool.push_back(codec);
 }
 
 // Look for a string from the dataset options or from the environment
@@ -282,8 +597,14 @@ template<typename T> CPLErr buff_fill(void *b, size_t count, const T ndv)
 {
     T *buffer = static_cast<T*>(b);
     count /= sizeof(T);
-    while (count--)
-	*buffer++ = ndv;
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    const __m128i v = vsplat(ndv);
+    for (; i + 16 / sizeof(T) <= count; i += 16 / sizeof(T))
+	_mm_storeu_si128((__m128i *)(buffer + i), v);
+#endif
+    for (; i < count; i++)
+	buffer[i] = ndv;
     return CE_None;
 }
 
@@ -320,14 +641,33 @@ CPLErr GDALMRFRasterBand::FillBlock(void *buffer)
     return CE_Failure;
 }
 
+/**
+*\brief The NoData values of the bands which share a page with this one
+*
+*/
+void GDALMRFRasterBand::PageNoData(std::vector<double> &ndv)
+{
+    int cstride = img.pagesize.c;
+    int first = (m_band / cstride) * cstride;
+    ndv.resize(cstride);
+    for (int c = 0; c < cstride; c++) {
+	GDALRasterBand *band = poDS->GetRasterBand(first + c + 1);
+	if (m_l) band = band->GetOverview(m_l -1);
+	int success;
+	ndv[c] = band->GetNoDataValue(&success);
+	if (!success) ndv[c] = 0.0;
+    }
+}
+
 /*\brief Interleave block read
  *
  *  Acquire space for all the other bands, unpack there, then drop the locks
  *  The current band output goes directly into the buffer
  */
 
-CPLErr GDALMRFRasterBand::RB(int xblk, int yblk, buf_mgr src, void *buffer) {
+CPLErr GDALMRFRasterBand::RB(int xblk, int yblk, buf_mgr src, void *buffer, bool swab) {
     vector<GDALRasterBlock *> blocks;
+    vector<char *> planes(poDS->nBands, (char *)NULL);
 
     for (int i = 0; i < poDS->nBands; i++) {
 	GDALRasterBand *b = poDS->GetRasterBand(i+1);
@@ -342,23 +682,12 @@ CPLErr GDALMRFRasterBand::RB(int xblk, int yblk, buf_mgr src, void *buffer) {
 	    ob = poBlock->GetDataRef();
 	    blocks.push_back(poBlock);
 	} 
-
-// Just the right mix of templates and macros make deinterleaving tidy
-#define CpySI(T) cpy_stride_in<T> (ob, (T *)poDS->pbuffer + i,\
-    blockSizeBytes()/sizeof(T), img.pagesize.c)
-
-	// Page is already in poDS->pbuffer, not empty
-	// There are only four cases, since only the real data type matters
-	switch (GDALGetDataTypeSize(eDataType)/8)
-	{
-	case 1: CpySI(GByte); break;
-	case 2: CpySI(GInt16); break;
-	case 4: CpySI(GInt32); break;
-	case 8: CpySI(GIntBig); break;
-	}
+	planes[i] = (char *)ob;
     }
 
-#undef CpySI
+    // Page is already in src.buffer, not empty. Split all the bands in one pass
+    int vsz = GDALGetDataTypeSize(eDataType) / 8;
+    deinterleave(&planes[0], src.buffer, blockSizeBytes() / vsz, img.pagesize.c, vsz, swab);
 
     // Drop the locks we acquired
     for (int i=0; i<blocks.size(); i++)
@@ -387,13 +716,23 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
 	return CE_Failure;
     }
 
+    // Fetches go one at a time, the source dataset is not thread safe.  The dataset
+    // mutex is only taken by the writes, so reads of cached tiles don't wait for the source
+    CPLMutexHolderD(&poDS->hFetchMutex);
+
+    // Another thread might have fetched this tile while we were waiting
+    ILIdx tinfo;
+    ILSize lreq(xblk, yblk, 0, m_band/img.pagesize.c, m_l);
+    if (buffer && CE_None == poDS->ReadTileIdx(tinfo, lreq, img)
+	&& (0 != tinfo.size || 0 != tinfo.offset))
+	return IReadBlock(xblk, yblk, buffer);
+
     if (poDS->clonedSource)  // This is a clone
 	return FetchClonedBlock(xblk, yblk, buffer);
 
     GDALDataset *poSrcDS;
     GInt32 cstride = img.pagesize.c;
     ILSize req(xblk, yblk, 0, m_band/cstride, m_l);
-    GUIntBig infooffset = IdxOffset(req, img);
 
     if ( 0 == (poSrcDS = poDS->GetSrcDS())) {
 	CPLError( CE_Failure, CPLE_AppDefined, "MRF: Can't open source file %s", poDS->source.c_str());
@@ -405,12 +744,35 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
     if ( 0 == m_l )
 	scl = 1; // To allow for precision issues
 
+    // The meta-tile is the group of up to N x N pages aligned to N which holds this page
+    // Only the bounding box of the pages not yet in the cache gets read
+    // The requested page goes last, so it ends up in the page buffer
+    std::vector<ILSize> todo;
+    int x0 = xblk, y0 = yblk, x1 = xblk, y1 = yblk;
+    if (metatile > 1) {
+	int gx = xblk - xblk % metatile, gy = yblk - yblk % metatile;
+	int gx1 = MIN(gx + metatile, img.pagecount.x), gy1 = MIN(gy + metatile, img.pagecount.y);
+	for (int y = gy; y < gy1; y++)
+	    for (int x = gx; x < gx1; x++) {
+		ILSize treq(x, y, 0, m_band/cstride, m_l);
+		if ((x == xblk && y == yblk) || CE_None != poDS->ReadTileIdx(tinfo, treq, img)
+		    || 0 != tinfo.size || 0 != tinfo.offset)
+		    continue;
+		todo.push_back(treq);
+		x0 = MIN(x0, x); x1 = MAX(x1, x);
+		y0 = MIN(y0, y); y1 = MAX(y1, y);
+	    }
+    }
+    todo.push_back(req);
+    int tx = x1 - x0 + 1;
+    int ty = y1 - y0 + 1;
+
     // Prepare parameters for RasterIO, they might be different from a full page
     int vsz = GDALGetDataTypeSize(eDataType)/8;
-    int Xoff = int(xblk * img.pagesize.x * scl + 0.5);
-    int Yoff = int(yblk * img.pagesize.y * scl + 0.5);
-    int readszx = int(img.pagesize.x * scl + 0.5);
-    int readszy = int(img.pagesize.y * scl + 0.5);
+    int Xoff = int(x0 * img.pagesize.x * scl + 0.5);
+    int Yoff = int(y0 * img.pagesize.y * scl + 0.5);
+    int readszx = int(tx * img.pagesize.x * scl + 0.5);
+    int readszy = int(ty * img.pagesize.y * scl + 0.5);
 
     // Compare with the full size and clip to the right and bottom if needed
     int clip=0;
@@ -423,41 +785,92 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
 	readszy = poDS->full.size.y - Yoff;
     }
 
-    // This is where the whole page fits
+    // This is where the whole read fits, a single page goes straight to the output,
+    // otherwise to a pool buffer.  A meta-tile is split one page at a time in pagebuf
     void *ob = buffer;
-    if (cstride != 1) 
-	ob = poDS->pbuffer;
+    char *meta = NULL;
+    void *pagebuf = NULL;
+    if (tx * ty > 1) {
+	ob = meta = static_cast<char *>(poDS->bpool.Acquire(size_t(tx) * ty * img.pageSizeBytes));
+	if (NULL == meta)
+	    return CE_Failure;
+    }
+    if (meta || cstride != 1 || NULL == buffer) {
+	pagebuf = poDS->bpool.Acquire(img.pageSizeBytes);
+	if (NULL == pagebuf) {
+	    poDS->bpool.Release(meta);
+	    return CE_Failure;
+	}
+	if (NULL == meta)
+	    ob = pagebuf;
+    }
 
-    // Fill buffer with NoData if clipping
+    // Fill buffer with NoData if clipping, each band with its own
+    std::vector<double> ndv;
+    PageNoData(ndv);
     if (clip)
-	FillBlock(ob);
+	FillPixels(eDataType, ob, size_t(tx) * ty * img.pageSizeBytes, &ndv[0], cstride);
+
+    // Line of a page, in bytes
+    size_t lbytes = size_t(vsz) * cstride * img.pagesize.x;
 
     // Use the dataset RasterIO to read all bands
     CPLErr ret = poSrcDS->RasterIO( GF_Read, Xoff, Yoff, readszx, readszy,
 	ob, pcount(readszx, int(scl)), pcount(readszy, int(scl)),
 	eDataType, cstride, (cstride==1)? &nBand:NULL,
 	// pixel, line, band stride
-	vsz * img.pagesize.c,
-	vsz * img.pagesize.c * img.pagesize.x, 
-	vsz * img.pagesize.c * img.pagesize.x * img.pagesize.y );
+	vsz * cstride, int(lbytes * tx), (cstride == 1) ? int(img.pageSizeBytes) : vsz );
+
+    // Store the pages
+    void *page = ob;
+    for (size_t i = 0; ret == CE_None && i < todo.size(); i++) {
+	if (meta) {
+	    page = (cstride == 1 && buffer && i == todo.size() - 1) ? buffer : pagebuf;
+	    const char *s = meta + (size_t(todo[i].y - y0) * img.pagesize.y * tx
+		+ (todo[i].x - x0)) * lbytes;
+	    for (int row = 0; row < img.pagesize.y; row++)
+		memcpy(static_cast<char *>(page) + row * lbytes, s + row * lbytes * tx, lbytes);
+	}
+	ret = CachePage(todo[i], page, &ndv[0]);
+    }
+
+    poDS->bpool.Release(meta);
 
-    if (ret != CE_None)
+    // If unpacking is not needed
+    if (ret != CE_None || cstride == 1) {
+	poDS->bpool.Release(pagebuf);
 	return ret;
-    // Might have the block in the pbuffer, mark it
-    poDS->tile = req;
+    }
+
+    // data is already in the page buffer, deinterlace it in pixel blocks
+    buf_mgr filesrc = {static_cast<char *>(page), img.pageSizeBytes};
+    ret = RB(xblk, yblk, filesrc, buffer);
+    poDS->bpool.Release(pagebuf);
+    return ret;
+}
+
+/**
+*\brief Compress and store a page fetched from the source, or mark it empty
+*
+* @param req The page location
+* @param page The raw page, not modified
+* @param ndv The NoData values of the bands in the page
+*
+*/
+CPLErr GDALMRFRasterBand::CachePage(const ILSize &req, void *page, const double *ndv)
+{
+    GUIntBig infooffset = IdxOffset(req, img);
 
     // Test to see if it need to be written, or just marked
-    int success;
-    double val = GetNoDataValue(&success);
-    if (!success) val = 0.0;
-    if (isAllVal(eDataType, ob, img.pageSizeBytes, val))
+    // The page is empty only if every band is its own NoData
+    if (isAllVal(eDataType, page, img.pageSizeBytes, ndv, img.pagesize.c))
 	return poDS->WriteTile((void *)1, infooffset, 0);
 
     // Write the page in the local cache
-    buf_mgr filesrc={(char *)ob, img.pageSizeBytes};
+    buf_mgr filesrc={(char *)page, img.pageSizeBytes};
 
     // Have to use a separate buffer for compression output.
-    void *outbuff = CPLMalloc(poDS->pbsize);
+    void *outbuff = poDS->bpool.Acquire(poDS->pbsize);
 
     if (!outbuff) {
 	CPLError(CE_Failure, CPLE_AppDefined, 
@@ -467,28 +880,15 @@ CPLErr GDALMRFRasterBand::FetchBlock(int xblk, int yblk, void *buffer)
     }
 
     buf_mgr filedst={(char *)outbuff, poDS->pbsize};
-    Compress(filedst, filesrc);
-
-    // Where the output is, in case we deflate
-    void *usebuff = outbuff;
-    if (deflate) {
-	usebuff = DeflateBlock( filedst, poDS->pbsize - filedst.size, deflate_flags);
-	if (!usebuff) {
-	    CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
-	    return CE_Failure;
-	}
+    if (CE_None != CompressPage(filedst, filesrc)) {
+	poDS->bpool.Release(outbuff);
+	return CE_Failure;
     }
 
     // Write and update the tile index
-    ret = poDS->WriteTile(usebuff, infooffset, filedst.size);
-    CPLFree(outbuff);
-
-    // If we hit an error or if unpaking is not needed
-    if (ret != CE_None || cstride == 1)
-	return ret;
-
-    // data is already in filesrc buffer, deinterlace it in pixel blocks
-    return RB(xblk, yblk, filesrc, buffer);
+    CPLErr ret = poDS->WriteTile(filedst.buffer, infooffset, filedst.size);
+    poDS->bpool.Release(outbuff);
+    return ret;
 }
 
 
@@ -552,11 +952,12 @@ CPLErr GDALMRFRasterBand::FetchClonedBlock(int xblk, int yblk, void *buffer)
     }
 
     // Need to read the tile from the source
-    char *buf = static_cast<char *>(CPLMalloc(tinfo.size));
+    char *buf = static_cast<char *>(poDS->bpool.Acquire(static_cast<size_t>(tinfo.size)));
+    if (NULL == buf)
+	return CE_Failure;
 
-    VSIFSeekL(srcfd, tinfo.offset, SEEK_SET);
-    if (tinfo.size != VSIFReadL( buf, 1, tinfo.size, srcfd) ) {
-	CPLFree(buf);
+    if (tinfo.size != GIntBig(poSrc->ReadDataAt(buf, tinfo.offset, static_cast<size_t>(tinfo.size)))) {
+	poDS->bpool.Release(buf);
 	CPLError( CE_Failure, CPLE_AppDefined, "MRF: Can't read data from source %s",
 	    poSrc->current.datfname.c_str() );
 	return CE_Failure;
@@ -564,7 +965,7 @@ CPLErr GDALMRFRasterBand::FetchClonedBlock(int xblk, int yblk, void *buffer)
 
     // Write it then reissue the read
     err = poDS->WriteTile(buf, infooffset, tinfo.size);
-    CPLFree(buf);
+    poDS->bpool.Release(buf);
     if ( CE_None != err )
 	return err;
     // Reissue read, it will work from the cloned data
@@ -610,69 +1011,256 @@ CPLErr GDALMRFRasterBand::IReadBlock(int xblk, int yblk, void *buffer)
     CPLDebug("MRF_IB","Tinfo offset %lld, size %lld\n", tinfo.offset, tinfo.size);
     // If we have a tile, read it
 
-    // Should use a permanent buffer, like the pbuffer mechanism
-    // Get a large buffer, in case we need to unzip
-    void *data = CPLMalloc(tinfo.size);
-
     VSILFILE *dfp = DataFP();
 
     // No data file to read from
     if (dfp == NULL)
 	return CE_Failure;
 
-    // This part is not thread safe, but it is what GDAL expects
-    VSIFSeekL(dfp, tinfo.offset, SEEK_SET);
-    if (1 != VSIFReadL(data, tinfo.size, 1, dfp)) {
-	CPLFree(data);
+    // The compressed page goes in a pool buffer, reused from tile to tile
+    void *data = poDS->bpool.Acquire(static_cast<size_t>(tinfo.size));
+    if (NULL == data)
+	return CE_Failure;
+
+    // Positional read, multiple threads can be reading at the same time
+    if (tinfo.size != GIntBig(poDS->ReadDataAt(data, tinfo.offset, static_cast<size_t>(tinfo.size)))) {
+	poDS->bpool.Release(data);
 	CPLError(CE_Failure, CPLE_AppDefined, "Unable to read data page, %ld@%lx",
 	    tinfo.size, tinfo.offset);
 	return CE_Failure;
     }
 
-    buf_mgr src = {(char *)data, tinfo.size};
-    buf_mgr dst;
+    buf_mgr src = {(char *)data, static_cast<size_t>(tinfo.size)};
+    CPLErr ret = DecodePage(xblk, yblk, src, buffer);
+    poDS->bpool.Release(data);
+    return ret;
+}
+
+/**
+*\brief Unpack a page as read from the data file, into dst
+*
+*  Does the inflate, the decompression and the byte swap, dst has to hold a full page.
+*  Doesn't use the block cache or the dataset page buffer, so it is thread safe
+*/
+
+CPLErr GDALMRFRasterBand::UnpackPage(buf_mgr src, buf_mgr &dst, bool swab)
+{
+    void *inflated = NULL;
 
     // We got the data, do we need to decompress it before decoding?
     if (deflate) {
-	dst.size = img.pageSizeBytes + 1440; // in case the packed page is a bit larger than the raw one
-	dst.buffer = (char *)CPLMalloc(dst.size);
-
-	if (ZUnPack(src, dst, deflate_flags)) {
+	buf_mgr tmp;
+	tmp.size = img.pageSizeBytes + 1440; // in case the packed page is a bit larger than the raw one
+	tmp.buffer = (char *)poDS->bpool.Acquire(tmp.size);
+
+	void *state = GetCodec(zdpool);
+	int ok = tmp.buffer && ZUnPack(src, tmp, deflate_flags, &state);
+	if (state)
+	    PutCodec(zdpool, state);
+	if (ok) {
 	    // Got it unpacked, update the pointers
-	    CPLFree(data);
-	    tinfo.size = dst.size;
-	    data = dst.buffer;
+	    inflated = tmp.buffer;
+	    src = tmp;
 	} else { // Warn and assume the data was not deflated
 	    CPLError(CE_Warning, CPLE_AppDefined, "Can't inflate page!");
-	    CPLFree(dst.buffer);
+	    poDS->bpool.Release(tmp.buffer);
 	}
     }
 
-    src.buffer = (char *)data;
-    src.size = tinfo.size;
-
-    // After unpacking, the size has to be pageSizeBytes
-    dst.buffer = (char *)buffer;
-    dst.size = img.pageSizeBytes;
-
-    // If pages are interleaved, use the dataset page buffer instead
-    if (1!=cstride)
-	dst.buffer = (char *)poDS->pbuffer;
+    // Shuffled pages are decompressed in a pool buffer, then unshuffled into dst
+    buf_mgr page = dst;
+    void *shuffled = NULL;
+    if (IL_SHUFFLE == predictor) {
+	shuffled = poDS->bpool.Acquire(img.pageSizeBytes);
+	if (NULL == shuffled) {
+	    poDS->bpool.Release(inflated);
+	    return CE_Failure;
+	}
+	page.buffer = (char *)shuffled;
+    }
 
-    CPLErr ret = Decompress(dst, src);
+    CPLErr ret = Decompress(page, src);
     dst.size = img.pageSizeBytes; // In case the decompress failed, force it back
-    CPLFree(data);
+    poDS->bpool.Release(inflated);
+
+    if (shuffled) {
+	unshuffle(dst.buffer, page.buffer, img.pageSizeBytes / (GDALGetDataTypeSize(img.dt) / 8),
+	    GDALGetDataTypeSize(img.dt) / 8);
+	poDS->bpool.Release(shuffled);
+    }
 
     // Swap whatever we decompressed if we need to
-    if (is_Endianess_Dependent(img.dt,img.comp) && (img.nbo != NET_ORDER) ) 
+    if (swab && is_Endianess_Dependent(img.dt,img.comp) && (img.nbo != NET_ORDER) ) 
 	swab_buff(dst, img);
 
+    if (IL_DELTA == predictor && CE_None == ret)
+	undelta_buff(dst, img);
+
+    return ret;
+}
+
+/**
+*\brief Decode a page from its stored form
+*
+*  The src holds the page as read from the data file, it is not modified.
+*  The output goes in buffer, for pixel interleaved pages the other bands
+*  are unpacked in the block cache
+*/
+
+CPLErr GDALMRFRasterBand::DecodePage(int xblk, int yblk, buf_mgr src, void *buffer)
+{
+    GInt32 cstride = img.pagesize.c;
+
+    // After unpacking, the size has to be pageSizeBytes
+    buf_mgr dst = {(char *)buffer, img.pageSizeBytes};
+
+    // If pages are interleaved, decode in a pool buffer instead of the shared dataset one
+    if (1!=cstride) {
+	dst.buffer = (char *)poDS->bpool.Acquire(img.pageSizeBytes);
+	if (NULL == dst.buffer)
+	    return CE_Failure;
+    }
+
+    // Interleaved pages get the byte swap while de-interleaving, unless the predictor needs it first
+    bool swab = (1 != cstride) && IL_DELTA != predictor
+	&& is_Endianess_Dependent(img.dt, img.comp) && (img.nbo != NET_ORDER);
+    CPLErr ret = UnpackPage(src, dst, !swab);
+
     // If pages are separate, we're done, the read was in the output buffer
-    if ( 1 == cstride || CE_None != ret)
+    if (1 == cstride)
 	return ret;
 
     // De-interleave page and return
-    return RB(xblk, yblk, dst, buffer);
+    if (CE_None == ret)
+	ret = RB(xblk, yblk, dst, buffer, swab);
+    poDS->bpool.Release(dst.buffer);
+    return ret;
+}
+
+/**
+*\brief Read a whole page, bypassing the block cache
+*
+*  Empty tiles are filled with NoData, tiles are not fetched from a cached source.
+*  Safe to call from multiple threads
+*/
+
+CPLErr GDALMRFRasterBand::ReadPage(int xblk, int yblk, void *page)
+{
+    ILIdx tinfo;
+    ILSize req(xblk, yblk, 0, m_band/img.pagesize.c, m_l);
+
+    if (CE_None != poDS->ReadTileIdx(tinfo, req, img)) {
+	CPLError( CE_Failure, CPLE_AppDefined,
+	    "MRF: Unable to read index at offset %lld", IdxOffset(req, img));
+	return CE_Failure;
+    }
+
+    if (0 == tinfo.size) {
+	std::vector<double> ndv;
+	PageNoData(ndv);
+	FillPixels(eDataType, page, img.pageSizeBytes, &ndv[0], img.pagesize.c);
+	return CE_None;
+    }
+
+    void *data = poDS->bpool.Acquire(static_cast<size_t>(tinfo.size));
+    if (NULL == data)
+	return CE_Failure;
+
+    if (tinfo.size != GIntBig(poDS->ReadDataAt(data, tinfo.offset, static_cast<size_t>(tinfo.size)))) {
+	poDS->bpool.Release(data);
+	CPLError(CE_Failure, CPLE_AppDefined, "Unable to read data page, %ld@%lx",
+	    tinfo.size, tinfo.offset);
+	return CE_Failure;
+    }
+
+    buf_mgr src = {(char *)data, static_cast<size_t>(tinfo.size)};
+    buf_mgr dst = {(char *)page, img.pageSizeBytes};
+    CPLErr ret = UnpackPage(src, dst);
+    poDS->bpool.Release(data);
+    return ret;
+}
+
+
+/**
+*\brief Encode a raw page, without the deflate step
+*
+*  Applies the delta predictor, the byte swap and the shuffle, in this order,
+*  then compresses.  The delta works on values, the shuffle on the stored bytes.
+*  src is not modified, the intermediate forms go in pool buffers
+*/
+
+CPLErr GDALMRFRasterBand::EncodePage(buf_mgr &dst, buf_mgr src)
+{
+    bool doswab = is_Endianess_Dependent(img.dt, img.comp) && (img.nbo != NET_ORDER);
+    // Compress functions need to return the compresed size in
+    // the bytes in buffer field
+    if (IL_NOPRED == predictor && !doswab)
+	return Compress(dst, src);
+
+    void *tmp = poDS->bpool.Acquire(src.size);
+    void *tmp2 = NULL;
+    if (NULL == tmp)
+	return CE_Failure;
+
+    buf_mgr page = {(char *)tmp, src.size};
+    if (IL_DELTA == predictor)
+	delta_buff(page, src, img);
+    else if (doswab)
+	memcpy(page.buffer, src.buffer, src.size);
+    else
+	page = src;
+
+    if (doswab)
+	swab_buff(page, img);
+
+    if (IL_SHUFFLE == predictor) {
+	int sz = GDALGetDataTypeSize(img.dt) / 8;
+	char *out = (char *)tmp;
+	if (page.buffer == tmp) {
+	    tmp2 = poDS->bpool.Acquire(src.size);
+	    if (NULL == tmp2) {
+		poDS->bpool.Release(tmp);
+		return CE_Failure;
+	    }
+	    out = (char *)tmp2;
+	}
+	shuffle(out, page.buffer, page.size / sz, sz);
+	page.buffer = out;
+    }
+
+    CPLErr ret = Compress(dst, page);
+    poDS->bpool.Release(tmp);
+    poDS->bpool.Release(tmp2);
+    return ret;
+}
+
+/**
+*\brief Compress a page, ready to be written
+*
+*  src holds the raw page, it is not modified.
+*  On return, dst points to the compressed page and holds its size,
+*  the output is always within the original dst buffer.
+*  The temporary buffers and codec states come from the dataset and band pools,
+*  which are mutex protected, so it can be called from multiple threads
+*/
+
+CPLErr GDALMRFRasterBand::CompressPage(buf_mgr &dst, buf_mgr &src)
+{
+    size_t avail = dst.size;
+
+    CPLErr ret = EncodePage(dst, src);
+    if (CE_None != ret)
+	return ret;
+
+    if (deflate) {
+	void *usebuff = DeflateBlock(dst, avail - dst.size, deflate_flags);
+	if (!usebuff) {
+	    CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
+	    return CE_Failure;
+	}
+	dst.buffer = (char *)usebuff;
+    }
+    return CE_None;
 }
 
 
@@ -711,30 +1299,18 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
 	buf_mgr src = {(char *)buffer, img.pageSizeBytes};
 	buf_mgr dst = {(char *)poDS->pbuffer, poDS->pbsize};
 
-	// Swab the source before encoding if we need to 
-	if (is_Endianess_Dependent(img.dt, img.comp) && (img.nbo != NET_ORDER)) 
-	    swab_buff(src, img);
-
-	// Compress functions need to return the compresed size in
-	// the bytes in buffer field
-	Compress(dst, src);
-	void *usebuff = dst.buffer;
-	if (deflate) {
-	    usebuff = DeflateBlock(dst, poDS->pbsize - dst.size, deflate_flags);
-	    if (!usebuff) {
-		CPLError(CE_Failure,CPLE_AppDefined, "MRF: Deflate error");
-		return CE_Failure;
-	    }
-	}
-	return poDS->WriteTile(usebuff, infooffset , dst.size);
+	CPLErr ret = CompressPage(dst, src);
+	if (CE_None != ret)
+	    return ret;
+	return poDS->WriteTile(dst.buffer, infooffset , dst.size);
     }
 
     // Multiple bands per page, use a temporary to assemble the page
     // Temporary is large because we use it to hold both the uncompressed and the compressed
     poDS->tile=req; poDS->bdirty=0;
 
-    // Keep track of what bands are empty
-    GUIntBig empties=0;
+    // Set when all bands are NoData
+    bool empty = false;
 
     void *tbuffer = CPLMalloc(img.pageSizeBytes + poDS->pbsize);
 
@@ -744,9 +1320,11 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
     }
 	
     // Get the other bands from the block cache
+    vector<char *> planes(poDS->nBands, (char *)NULL);
+    vector<GDALRasterBlock *> blocks;
     for (int iBand=0; iBand < poDS->nBands; iBand++ )
     {
-	const char *pabyThisImage=NULL;
+	char *pabyThisImage=NULL;
 	GDALRasterBlock *poBlock=NULL;
 
 	if (iBand == m_band)
@@ -764,41 +1342,55 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
 
 	    pabyThisImage = (char*) poBlock->GetDataRef();
 	    poDS->bdirty |= bandbit(iBand);
+	    blocks.push_back(poBlock);
 	}
+	planes[iBand] = pabyThisImage;
+    }
 
-	// Keep track of empty bands, but encode them anyhow, in case some are not empty
-	int success;
-	double val = GetNoDataValue(&success);
-	if (!success) val = 0.0;
-	if (isAllVal(eDataType, buffer, img.pageSizeBytes, val))
-	    empties != bandbit(iBand);
+    // Bands not in the cache are written as their own NoData
+    vector<void *> fills;
+    bool complete = true;
+    for (int iBand=0; iBand < poDS->nBands; iBand++) {
+	if (NULL != planes[iBand])
+	    continue;
+	void *fill = poDS->bpool.Acquire(blockSizeBytes());
+	if (NULL == fill) {
+	    complete = false;
+	    break;
+	}
+	fills.push_back(fill);
+	GDALRasterBand *band = poDS->GetRasterBand(iBand +1);
+	if (m_l) band = band->GetOverview(m_l -1);
+	((GDALMRFRasterBand *)band)->FillBlock(fill);
+	planes[iBand] = (char *)fill;
+    }
 
-	// Copy the data into the dataset buffer here
-	// Just the right mix of templates and macros make this real tidy
-#define CpySO(T) cpy_stride_out<T> (((T *)tbuffer)+iBand, pabyThisImage,\
-		blockSizeBytes()/sizeof(T), cstride)
+    // Build the page in tbuffer, all bands in one pass
+    int vsz = GDALGetDataTypeSize(eDataType) / 8;
+    if (complete)
+	interleave((char *)tbuffer, &planes[0], blockSizeBytes() / vsz, cstride, vsz);
+    for (size_t i = 0; i < fills.size(); i++)
+	poDS->bpool.Release(fills[i]);
+
+    // An empty page is one where every band is its own NoData
+    if (complete) {
+	vector<double> ndv;
+	PageNoData(ndv);
+	if (isAllVal(eDataType, tbuffer, img.pageSizeBytes, &ndv[0], cstride))
+	    empty = true;
+    }
 
-	// Build the page in tbuffer
-	switch (GDALGetDataTypeSize(eDataType)/8)
-	{
-	    case 1: CpySO(GByte); break;
-	    case 2: CpySO(GInt16); break;
-	    case 4: CpySO(GInt32); break;
-	    case 8: CpySO(GIntBig); break;
-	    default:
-		CPLError(CE_Failure,CPLE_AppDefined, "MRF: Write datatype of %d bytes "
-			"not implemented", GDALGetDataTypeSize(eDataType)/8);
-		return CE_Failure;
-	}
+    for (size_t i = 0; i < blocks.size(); i++) {
+	blocks[i]->MarkClean();
+	blocks[i]->DropLock();
+    }
 
-	if (poBlock != NULL)
-	{
-	    poBlock->MarkClean();
-	    poBlock->DropLock();
-	}
+    if (!complete) {
+	CPLFree(tbuffer);
+	return CE_Failure;
     }
 
-    if (empties == AllBandMask()) {
+    if (empty) {
 	CPLFree(tbuffer);
 	return poDS->WriteTile(0, infooffset, 0);
     }
@@ -816,7 +1408,10 @@ CPLErr GDALMRFRasterBand::IWriteBlock(int xblk, int yblk, void *buffer)
     char *outbuff = (char *)tbuffer + img.pageSizeBytes;
 
     buf_mgr dst = {outbuff, poDS->pbsize};
-    Compress(dst, src);
+    if (CE_None != EncodePage(dst, src)) {
+	CPLFree(tbuffer);
+	return CE_Failure;
+    }
 
     // Where the output is, in case we deflate
     void *usebuff = outbuff;
@@ -32,14 +32,47 @@
 #include "marfa.h"
 #include <zlib.h>
 
+#if defined(LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
+#if defined(MRF_USE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(MRF_USE_AVX2)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
 static const char *ILC_N[]={ "PNG", "PPNG", "JPEG", "NONE", "DEFLATE", "TIF", 
 #if defined(LERC)
 	"LERC", 
+#endif
+#if defined(ZSTD)
+	"ZSTD",
+#endif
+#if defined(LZ4)
+	"LZ4",
 #endif
 	"Unknown" };
 static const char *ILC_E[]={ ".ppg", ".ppg", ".pjg", ".til", ".pzp", ".ptf", 
 #if defined(LERC)
 	".lrc" ,
+#endif
+#if defined(ZSTD)
+	".pzs",
+#endif
+#if defined(LZ4)
+	".pl4",
 #endif
 	"" };
 static const char *ILO_N[]={ "PIXEL", "BAND", "LINE", "Unknown" };
@@ -259,6 +292,14 @@ bool is_Endianess_Dependent(GDALDataType dt, ILCompression comp) {
     if (IL_ZLIB == comp || IL_NONE == comp)
 	if (GDALGetDataTypeSize( dt ) > 8)
 	    return true;
+#if defined(ZSTD)
+    if (IL_ZSTD == comp && GDALGetDataTypeSize( dt ) > 8)
+	return true;
+#endif
+#if defined(LZ4)
+    if (IL_LZ4 == comp && GDALGetDataTypeSize( dt ) > 8)
+	return true;
+#endif
     return false;
 }
 
@@ -294,6 +335,12 @@ void GDALRegister_mrf(void)
 	    "       <Value>NONE</Value>"
 #if defined(LERC)
 	    "	    <Value>LERC</Value>"
+#endif
+#if defined(ZSTD)
+	    "	    <Value>ZSTD</Value>"
+#endif
+#if defined(LZ4)
+	    "	    <Value>LZ4</Value>"
 #endif
 	    "   </Option>\n"
 	    "   <Option name='INTERLEAVE' type='string-select' default='PIXEL'>\n"
@@ -310,6 +357,7 @@ void GDALRegister_mrf(void)
 //	    "	<Option name='CLONE' type='boolean' description='Is this to be a clone of the cached MRF source'/>\n"
 	    "	<Option name='UNIFORM_SCALE' type='int' description='Uniform overlays in MRF, only 2 is tested'/>\n"
 	    "	<Option name='NOCOPY' type='boolean' description='Leave created MRF empty, default=no'/>\n"
+	    "	<Option name='NUM_THREADS' type='string' description='Number of threads used to compress pages in CreateCopy, or ALL_CPUS, default=1'/>\n"
 	    "</CreationOptionList>\n");
 
 	driver->pfnOpen = GDALMRFDataset::Open;
@@ -335,6 +383,12 @@ GDALMRFRasterBand *newMRFRasterBand(GDALMRFDataset *pDS, const ILImage &image, i
     case IL_TIF:  bnd = new TIF_Band(pDS,image,b,level);  break;
 #if defined(LERC)
     case IL_LERC: bnd = new LERC_Band(pDS,image,b,level); break;
+#endif
+#if defined(ZSTD)
+    case IL_ZSTD: bnd = new ZSTD_Band(pDS,image,b,level); break;
+#endif
+#if defined(LZ4)
+    case IL_LZ4:  bnd = new LZ4_Band(pDS,image,b,level);  break;
 #endif
     default:
 	return NULL;
@@ -480,9 +534,410 @@ int CheckFileSize(const char *fname, GIntBig sz, GDALAccess eAccess) {
     return !ret;
 };
 
+/**
+ *\brief Create a file of a given size, atomically
+ *
+ * The file is sized under a temporary name then hard linked in place, so other
+ * processes never see it short.  If another process wins the race, its file is used,
+ * as long as it is large enough.  The temporary name is unique within the process.
+ * Only for local files, the caller has to use the non-atomic path if this fails
+ */
+int NewFileAtomic(const char *fname, GIntBig sz) {
+#if defined(WIN32)
+    return false;
+#else
+    if (EQUALN(fname, "/vsi", 4))
+	return false;
+    // The pid alone is shared by the threads, the counter isn't.  A name left over by
+    // a dead process with the same pid is skipped
+    static volatile int counter = 0;
+    CPLString tmp;
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < 16; tries++) {
+	tmp.Printf("%s.%d.%d.tmp", fname, int(getpid()), CPLAtomicInc(&counter));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0 && EEXIST != errno)
+	    return false;
+    }
+    if (fd < 0)
+	return false;
+    // Sparse, it doesn't matter how large it is
+    int ret = (0 == ftruncate(fd, off_t(sz)));
+    close(fd);
+    // Fails if the file is already there, which is fine if it is large enough.  It
+    // might have been made by the non-atomic path and not extended yet
+    if (ret && 0 != link(tmp, fname)) {
+	VSIStatBufL statb;
+	ret = (EEXIST == errno && 0 == VSIStatL(fname, &statb) && statb.st_size >= sz);
+    }
+    unlink(tmp);
+    return ret;
+#endif
+}
+
+/**
+ *\brief Open a handle for positional reads
+ *
+ * Only plain local files can be read this way, everything else should use the VSI 
+ * file under a lock.  Not implemented on windows yet
+ */
+int PReadOpen(const char *fname) {
+#if defined(WIN32)
+    return -1;
+#else
+    if (EQUALN(fname, "/vsi", 4))
+	return -1;
+    return open(fname, O_RDONLY);
+#endif
+}
+
+void PReadClose(int fd) {
+#if !defined(WIN32)
+    if (fd >= 0)
+	close(fd);
+#endif
+}
+
+size_t PRead(int fd, void *buff, size_t size, GIntBig offset) {
+#if defined(WIN32)
+    return 0;
+#else
+    size_t got = 0;
+    // pread can return less than requested, or be interrupted
+    while (got < size) {
+	ssize_t r = pread(fd, (char *)buff + got, size - got, off_t(offset + got));
+	if (r > 0)
+	    got += r;
+	else if (r == 0 || errno != EINTR)
+	    break;
+    }
+    return got;
+#endif
+}
+
+void PReadAdvise(int fd, GIntBig offset, GIntBig size) {
+#if !defined(WIN32) && defined(POSIX_FADV_WILLNEED)
+    if (fd >= 0)
+	posix_fadvise(fd, off_t(offset), off_t(size), POSIX_FADV_WILLNEED);
+#endif
+}
+
+/**
+ *\brief Open a handle for advisory locks on a local file
+ *
+ * The lock belongs to the open file, not to the process, so separate handles exclude
+ * each other also within a process.  It doesn't stop reads or writes, it only
+ * serializes the handles which take it.  Not implemented on windows yet
+ */
+int LockOpen(const char *fname) {
+#if defined(WIN32)
+    return -1;
+#else
+    if (EQUALN(fname, "/vsi", 4))
+	return -1;
+    return open(fname, O_RDWR);
+#endif
+}
+
+bool FileLock(int fd, bool lock) {
+#if defined(WIN32)
+    return false;
+#else
+    if (fd < 0)
+	return false;
+    // The classic fcntl locks belong to the process, they don't exclude the other
+    // datasets of the same process, and closing any handle of the file drops them
+#if defined(F_OFD_SETLKW)
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = lock ? F_WRLCK : F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 1;
+    // Waiting for the lock can be interrupted
+    int r;
+    while (-1 == (r = fcntl(fd, lock ? F_OFD_SETLKW : F_OFD_SETLK, &fl)) && EINTR == errno)
+	;
+    if (0 == r)
+	return true;
+    // Kernels older than the headers don't have them, try flock
+    if (EINVAL != errno)
+	return false;
+#endif
+#if defined(LOCK_EX)
+    while (-1 == flock(fd, lock ? LOCK_EX : LOCK_UN))
+	if (errno != EINTR)
+	    return false;
+    return true;
+#else
+    return false;
+#endif
+#endif
+}
+
+void *MMapOpen(int fd, size_t size) {
+#if defined(WIN32)
+    return NULL;
+#else
+    if (fd < 0 || 0 == size)
+	return NULL;
+    // Private, so writes to the file by others are not required to show up
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return (MAP_FAILED == p) ? NULL : p;
+#endif
+}
+
+void MMapClose(void *p, size_t size) {
+#if !defined(WIN32)
+    if (p)
+	munmap(p, size);
+#endif
+}
+
+MRFBufferPool::~MRFBufferPool()
+{
+    for (size_t i = 0; i < avail.size(); i++)
+	CPLFree(avail[i].buffer);
+    // Should be empty, unless somebody forgot to release
+    for (size_t i = 0; i < inuse.size(); i++)
+	CPLFree(inuse[i].buffer);
+    if (hMutex)
+	CPLDestroyMutex(hMutex);
+}
+
+/**
+ *\brief Get a buffer of at least sz bytes from the pool
+ *
+ * Picks an available buffer that is large enough, or grows the largest one
+ */
+void *MRFBufferPool::Acquire(size_t sz)
+{
+    CPLMutexHolderD(&hMutex);
+    int pick = -1;
+    for (int i = 0; i < int(avail.size()); i++)
+	if (pick < 0 || avail[i].size > avail[pick].size) {
+	    pick = i;
+	    if (avail[i].size >= sz)
+		break;
+	}
+
+    buf_mgr b = {NULL, 0};
+    if (pick >= 0) {
+	b = avail[pick];
+	avail.erase(avail.begin() + pick);
+    }
+
+    if (b.size >= sz)
+	hits++;
+    else {
+	grows++;
+	void *p = VSIRealloc(b.buffer, sz);
+	if (NULL == p) {
+	    CPLError(CE_Failure, CPLE_OutOfMemory, "MRF: Can't allocate %lld bytes", GIntBig(sz));
+	    // Keep the old one around
+	    if (b.buffer)
+		avail.push_back(b);
+	    return NULL;
+	}
+	b.buffer = (char *)p;
+	b.size = sz;
+    }
+
+    inuse.push_back(b);
+    return b.buffer;
+}
+
+void MRFBufferPool::GetStats(GIntBig &nhits, GIntBig &ngrows)
+{
+    CPLMutexHolderD(&hMutex);
+    nhits = hits;
+    ngrows = grows;
+}
+
+void MRFBufferPool::Release(void *buffer)
+{
+    if (NULL == buffer)
+	return;
+    CPLMutexHolderD(&hMutex);
+    for (size_t i = 0; i < inuse.size(); i++)
+	if (inuse[i].buffer == buffer) {
+	    avail.push_back(inuse[i]);
+	    inuse.erase(inuse.begin() + i);
+	    return;
+	}
+    // Not ours, this is a bug
+    CPLError(CE_Warning, CPLE_AppDefined, "MRF: Releasing a buffer that doesn't belong to the pool");
+}
+
+#if defined(MRF_USE_AVX2)
+// The OS has to save the ymm registers, older compilers don't check it in __builtin_cpu_supports
+static int OSHasAVX()
+{
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE))
+	return FALSE;
+    // xgetbv, as bytes so it doesn't need -mxsave
+    __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a"(a), "=d"(d) : "c"(0));
+    // Both the xmm and the ymm state
+    return 6 == (a & 6);
+}
+#endif
+
+int CPUHasAVX2()
+{
+#if defined(MRF_USE_AVX2)
+    // Checked once, the CPU, the OS and the option
+    static int state = -1;
+    if (state < 0)
+	state = __builtin_cpu_supports("avx2") && OSHasAVX()
+	    && !CSLTestBoolean(CPLGetConfigOption("MRF_NO_AVX2", "NO"));
+    return state;
+#else
+    return FALSE;
+#endif
+}
+
+int ThreadCount(const char *value)
+{
+    if (NULL == value)
+	return 1;
+    int n = EQUAL(value, "ALL_CPUS") ? CPLGetNumCPUs() : atoi(value);
+    return MAX(1, n);
+}
+
+// Shared state for RunParallel
+typedef struct {
+    void (*pfn)(void *, int);
+    void *arg;
+    int count;
+    int next;
+    void *hMutex;
+} ParallelWork;
+
+// Each thread keeps picking the next item until there are none left
+static void ParallelWorker(void *p)
+{
+    ParallelWork *w = (ParallelWork *)p;
+    for (;;) {
+	int i;
+	{
+	    CPLMutexHolderD(&w->hMutex);
+	    i = w->next++;
+	}
+	if (i >= w->count)
+	    return;
+	w->pfn(w->arg, i);
+    }
+}
+
+/**
+ *\brief Run count work items on a few threads
+ *
+ * The calling thread works too, so nThreads - 1 threads are created.
+ * Items are picked in order, but they might finish in any order
+ */
+void RunParallel(int nThreads, int count, void (*pfn)(void *, int), void *arg)
+{
+    ParallelWork w = {pfn, arg, count, 0, NULL};
+    nThreads = MIN(nThreads, count);
+    std::vector<CPLJoinableThread *> threads;
+    for (int i = 1; i < nThreads; i++) {
+	CPLJoinableThread *t = CPLCreateJoinableThread(ParallelWorker, &w);
+	if (t)
+	    threads.push_back(t);
+    }
+    ParallelWorker(&w);
+    for (size_t i = 0; i < threads.size(); i++)
+	CPLJoinThread(threads[i]);
+    if (w.hMutex)
+	CPLDestroyMutex(w.hMutex);
+}
+
+#if defined(LIBDEFLATE)
+// One shot libdeflate versions of ZPack and ZUnPack, the streams are the same format
+// They return false when they can't do it, the zlib code is used then
+// The compressor or decompressor is kept in *state for the next call, if state is not NULL
+
+static bool LDPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state) {
+    int level = std::min(9, flags & ZFLAG_LMASK);
+    // No store only level and no zlib strategies
+    if (0 == level || 0 != (flags & ZFLAG_SMASK))
+	return false;
+
+    struct libdeflate_compressor *c = state ? (struct libdeflate_compressor *)*state : NULL;
+    if (NULL == c && NULL == (c = libdeflate_alloc_compressor(level)))
+	return false;
+
+    size_t sz;
+    if (flags & ZFLAG_GZ)
+	sz = libdeflate_gzip_compress(c, src.buffer, src.size, dst.buffer, dst.size);
+    else if (flags & ZFLAG_RAW)
+	sz = libdeflate_deflate_compress(c, src.buffer, src.size, dst.buffer, dst.size);
+    else
+	sz = libdeflate_zlib_compress(c, src.buffer, src.size, dst.buffer, dst.size);
+    if (state)
+	*state = c;
+    else
+	libdeflate_free_compressor(c);
+
+    if (0 == sz) // Doesn't fit
+	return false;
+    dst.size = sz;
+    return true;
+}
+
+static bool LDUnPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state) {
+    struct libdeflate_decompressor *d = state ? (struct libdeflate_decompressor *)*state : NULL;
+    if (NULL == d && NULL == (d = libdeflate_alloc_decompressor()))
+	return false;
+
+    size_t sz = 0;
+    enum libdeflate_result res;
+    const unsigned char *h = (const unsigned char *)src.buffer;
+    if (ZFLAG_RAW & flags)
+	res = libdeflate_deflate_decompress(d, src.buffer, src.size, dst.buffer, dst.size, &sz);
+    // Detect the gzip header, same as zlib does
+    else if (src.size > 2 && 0x1f == h[0] && 0x8b == h[1])
+	res = libdeflate_gzip_decompress(d, src.buffer, src.size, dst.buffer, dst.size, &sz);
+    else
+	res = libdeflate_zlib_decompress(d, src.buffer, src.size, dst.buffer, dst.size, &sz);
+    if (state)
+	*state = d;
+    else
+	libdeflate_free_decompressor(d);
+
+    if (LIBDEFLATE_SUCCESS != res)
+	return false;
+    dst.size = sz;
+    return true;
+}
+#endif
+
+// Frees a state returned by ZPack or ZUnPack
+void ZFreeState(void *state, bool pack) {
+#if defined(LIBDEFLATE)
+    if (NULL == state)
+	return;
+    if (pack)
+	libdeflate_free_compressor((struct libdeflate_compressor *)state);
+    else
+	libdeflate_free_decompressor((struct libdeflate_decompressor *)state);
+#else
+    (void)state;
+    (void)pack;
+#endif
+}
+
 // Similar to compress2() but with flags to control zlib features
 // Returns true if it worked
-int ZPack(const buf_mgr &src, buf_mgr &dst, int flags) {
+int ZPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state) {
+#if defined(LIBDEFLATE)
+    if (LDPack(src, dst, flags, state))
+	return true;
+#else
+    (void)state;
+#endif
+
     z_stream stream = {0};
     int err;
 
@@ -515,7 +970,13 @@ int ZPack(const buf_mgr &src, buf_mgr &dst, int flags) {
 
 // Similar to uncompress() from zlib, accepts the ZFLAG_RAW
 // Return true if it worked
-int ZUnPack(const buf_mgr &src, buf_mgr &dst, int flags) {
+int ZUnPack(const buf_mgr &src, buf_mgr &dst, int flags, void **state) {
+#if defined(LIBDEFLATE)
+    if (LDUnPack(src, dst, flags, state))
+	return true;
+#else
+    (void)state;
+#endif
 
     z_stream stream = {0};
     int err;
@@ -540,3 +1001,343 @@ int ZUnPack(const buf_mgr &src, buf_mgr &dst, int flags) {
     return err == Z_OK;
 }
 
+#if defined(MRF_USE_SSE2)
+// Splits pairs of vectors in the even and the odd samples of SZ bytes, n is the number of pairs
+template<int SZ> static inline void split_v(const __m128i *in, __m128i *even, __m128i *odd, int n)
+{
+    const __m128i mask = _mm_set1_epi16(0xff);
+    for (int k = 0; k < n; k++) {
+	__m128i a = in[2 * k], b = in[2 * k + 1];
+	if (1 == SZ) {
+	    even[k] = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+	    odd[k] = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+	} else { // Sign extended, the saturation doesn't kick in
+	    even[k] = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+		_mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+	    odd[k] = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+	}
+    }
+}
+
+// The reverse of split_v
+template<int SZ> static inline void merge_v(const __m128i *even, const __m128i *odd, __m128i *out, int n)
+{
+    for (int k = 0; k < n; k++) {
+	if (1 == SZ) {
+	    out[2 * k] = _mm_unpacklo_epi8(even[k], odd[k]);
+	    out[2 * k + 1] = _mm_unpackhi_epi8(even[k], odd[k]);
+	} else {
+	    out[2 * k] = _mm_unpacklo_epi16(even[k], odd[k]);
+	    out[2 * k + 1] = _mm_unpackhi_epi16(even[k], odd[k]);
+	}
+    }
+}
+
+// Byte swap of every SZ byte value
+template<int SZ> static inline __m128i vswab(__m128i x)
+{
+    if (8 == SZ)
+	x = _mm_shuffle_epi32(x, 0xb1);
+    if (4 == SZ || 8 == SZ)
+	x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+    if (1 != SZ)
+	x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    return x;
+}
+
+// Vector deinterleave for C of 2, 3, 4 or 8
+// Each pass interleaves register j with register j + R/2, where R is the register count.
+// After log2 of the samples per vector passes, one more for three bands, the pixel
+// interleaved data is band sequential, R/C registers per band
+// The values are byte swapped on the way when swab is set
+// Returns the number of pixels done
+template<int SZ, int C> static size_t split_planes(char **dst, const char *src, size_t count, bool swab)
+{
+    const int R = (3 == C) ? 6 : C;
+    const int NP = (3 == C ? 6 : 5) - SZ;
+    const size_t w = R * 16 / (C * SZ);
+    __m128i v[R], t[R];
+    size_t i = 0;
+    for (; i + w <= count; i += w) {
+	for (int k = 0; k < R; k++)
+	    v[k] = _mm_loadu_si128((const __m128i *)(src + i * C * SZ) + k);
+	if (swab)
+	    for (int k = 0; k < R; k++)
+		v[k] = vswab<SZ>(v[k]);
+	for (int pass = 0; pass < NP; pass++) {
+	    for (int j = 0; j < R / 2; j++)
+		merge_v<SZ>(v + j, v + j + R / 2, t + 2 * j, 1);
+	    for (int k = 0; k < R; k++)
+		v[k] = t[k];
+	}
+	for (int b = 0; b < C; b++)
+	    for (int q = 0; q < R / C; q++)
+		_mm_storeu_si128((__m128i *)(dst[b] + i * SZ) + q, v[b * R / C + q]);
+    }
+    return i;
+}
+
+// The reverse of split_planes for 2, 4 or 8 bands, log2(C) passes of the same kind
+template<int SZ, int C> static size_t merge_planes(char *dst, char **src, size_t count)
+{
+    const size_t w = 16 / SZ;
+    __m128i v[C], t[C];
+    size_t i = 0;
+    for (; i + w <= count; i += w) {
+	for (int b = 0; b < C; b++)
+	    v[b] = _mm_loadu_si128((const __m128i *)(src[b] + i * SZ));
+	for (int g = C / 2; g >= 1; g /= 2) {
+	    const int gsz = C / g;
+	    for (int j = 0; j < g; j++)
+		merge_v<SZ>(v + j * gsz / 2, v + (j + g) * gsz / 2, t + j * gsz, gsz / 2);
+	    for (int k = 0; k < C; k++)
+		v[k] = t[k];
+	}
+	for (int k = 0; k < C; k++)
+	    _mm_storeu_si128((__m128i *)(dst + i * C * SZ) + k, v[k]);
+    }
+    return i;
+}
+
+// The reverse of split_planes for three bands, split_v undoes one pass
+template<int SZ> static size_t merge_planes3(char *dst, char **src, size_t count)
+{
+    const size_t w = 32 / SZ;
+    __m128i v[6], t[6];
+    size_t i = 0;
+    for (; i + w <= count; i += w) {
+	for (int b = 0; b < 3; b++) {
+	    v[2 * b] = _mm_loadu_si128((const __m128i *)(src[b] + i * SZ));
+	    v[2 * b + 1] = _mm_loadu_si128((const __m128i *)(src[b] + i * SZ) + 1);
+	}
+	for (int pass = 0; pass < 6 - SZ; pass++) {
+	    for (int j = 0; j < 3; j++)
+		split_v<SZ>(v + 2 * j, t + j, t + j + 3, 1);
+	    for (int k = 0; k < 6; k++)
+		v[k] = t[k];
+	}
+	for (int k = 0; k < 6; k++)
+	    _mm_storeu_si128((__m128i *)(dst + i * 3 * SZ) + k, v[k]);
+    }
+    return i;
+}
+
+#if defined(MRF_USE_AVX2)
+// Three bands with byte shuffles, for 8 and 16 bit values.  Three input registers hold
+// 16/sz pixels, each band register gathers its bytes from all three.
+// Selected at run time, it needs SSSE3 but is only compiled for AVX2 targets
+// m[b][r] picks the bytes of band b from input register r, with the byte swap folded in
+static void split3_masks(GByte m[3][3][16], int sz, bool swab)
+{
+    for (int b = 0; b < 3; b++)
+	for (int r = 0; r < 3; r++)
+	    for (int p = 0; p < 16; p++) {
+		int k = swab ? sz - 1 - p % sz : p % sz;
+		int off = (p / sz * 3 + b) * sz + k;
+		m[b][r][p] = GByte((off / 16 == r) ? off % 16 : 0x80);
+	    }
+}
+
+// m[r][b] picks the bytes of output register r from band b
+static void merge3_masks(GByte m[3][3][16], int sz)
+{
+    for (int r = 0; r < 3; r++)
+	for (int b = 0; b < 3; b++)
+	    for (int p = 0; p < 16; p++) {
+		int el = (r * 16 + p) / sz;
+		m[r][b][p] = GByte((el % 3 == b) ? el / 3 * sz + p % sz : 0x80);
+	    }
+}
+
+MRF_AVX2 static size_t split3_shuf(char **dst, const char *src, size_t count, int sz, bool swab)
+{
+    GByte mb[3][3][16];
+    split3_masks(mb, sz, swab);
+    __m128i m[3][3];
+    for (int b = 0; b < 3; b++)
+	for (int r = 0; r < 3; r++)
+	    m[b][r] = _mm_loadu_si128((const __m128i *)mb[b][r]);
+    const size_t w = 16 / sz;
+    size_t i = 0;
+    for (; i + w <= count; i += w) {
+	const __m128i *s = (const __m128i *)(src + i * 3 * sz);
+	__m128i v0 = _mm_loadu_si128(s), v1 = _mm_loadu_si128(s + 1), v2 = _mm_loadu_si128(s + 2);
+	for (int b = 0; b < 3; b++)
+	    _mm_storeu_si128((__m128i *)(dst[b] + i * sz),
+		_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m[b][0]), _mm_shuffle_epi8(v1, m[b][1])),
+		    _mm_shuffle_epi8(v2, m[b][2])));
+    }
+    return i;
+}
+
+MRF_AVX2 static size_t merge3_shuf(char *dst, char **src, size_t count, int sz)
+{
+    GByte mb[3][3][16];
+    merge3_masks(mb, sz);
+    __m128i m[3][3];
+    for (int r = 0; r < 3; r++)
+	for (int b = 0; b < 3; b++)
+	    m[r][b] = _mm_loadu_si128((const __m128i *)mb[r][b]);
+    const size_t w = 16 / sz;
+    size_t i = 0;
+    for (; i + w <= count; i += w) {
+	__m128i v0 = _mm_loadu_si128((const __m128i *)(src[0] + i * sz));
+	__m128i v1 = _mm_loadu_si128((const __m128i *)(src[1] + i * sz));
+	__m128i v2 = _mm_loadu_si128((const __m128i *)(src[2] + i * sz));
+	for (int r = 0; r < 3; r++)
+	    _mm_storeu_si128((__m128i *)(dst + i * 3 * sz) + r,
+		_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m[r][0]), _mm_shuffle_epi8(v1, m[r][1])),
+		    _mm_shuffle_epi8(v2, m[r][2])));
+    }
+    return i;
+}
+#endif
+
+// Pick the vector code for the band count, returns the pixels done
+template<int SZ> static size_t split_any(char **dst, const char *src, size_t count, int c, bool swab)
+{
+#if defined(MRF_USE_AVX2)
+    if (3 == c && CPUHasAVX2())
+	return split3_shuf(dst, src, count, SZ, swab);
+#endif
+    switch (c) {
+    case 2: return split_planes<SZ, 2>(dst, src, count, swab);
+    case 3: return (1 == SZ) ? split_planes<SZ, 3>(dst, src, count, swab) : 0;
+    case 4: return split_planes<SZ, 4>(dst, src, count, swab);
+    case 8: return split_planes<SZ, 8>(dst, src, count, swab);
+    }
+    return 0;
+}
+
+template<int SZ> static size_t merge_any(char *dst, char **src, size_t count, int c)
+{
+#if defined(MRF_USE_AVX2)
+    if (3 == c && CPUHasAVX2())
+	return merge3_shuf(dst, src, count, SZ);
+#endif
+    switch (c) {
+    case 2: return merge_planes<SZ, 2>(dst, src, count);
+    case 3: return (1 == SZ) ? merge_planes3<SZ>(dst, src, count) : 0;
+    case 4: return merge_planes<SZ, 4>(dst, src, count);
+    case 8: return merge_planes<SZ, 8>(dst, src, count);
+    }
+    return 0;
+}
+#endif
+
+// Byte swap, picked by type
+static inline GByte bswap(GByte v) { return v; }
+static inline GUInt16 bswap(GUInt16 v) { return swab16(v); }
+static inline GUInt32 bswap(GUInt32 v) { return swab32(v); }
+static inline GUIntBig bswap(GUIntBig v) { return swab64(v); }
+
+// Scalar deinterleave from pixel i on, a band at a time is faster than a pixel at a time
+template<typename T> static void deinterleave_t(char **dst, const char *src, size_t i, size_t count, int c,
+    bool swab)
+{
+    for (int b = 0; b < c; b++) {
+	const T *s = (const T *)src + i * c + b;
+	T *d = (T *)dst[b];
+	if (swab)
+	    for (size_t k = i; k < count; k++, s += c)
+		d[k] = bswap(*s);
+	else
+	    for (size_t k = i; k < count; k++, s += c)
+		d[k] = *s;
+    }
+}
+
+template<typename T> static void interleave_t(char *dst, char **src, size_t i, size_t count, int c)
+{
+    for (int b = 0; b < c; b++) {
+	const T *s = (const T *)src[b];
+	T *d = (T *)dst + i * c + b;
+	for (size_t k = i; k < count; k++, d += c)
+	    *d = s[k];
+    }
+}
+
+/**
+ *\brief Split a pixel interleaved buffer in separate bands, in a single pass
+ *
+ * Byte samples with 2, 3, 4 or 8 bands and 16 bit samples with 2, 4 or 8 bands use SSE2 code
+ * Three bands use byte shuffles instead, for both sizes, when the CPU has AVX2
+ * With swab set, the values are also byte swapped
+ */
+void deinterleave(char **dst, const char *src, size_t count, int c, int sz, bool swab)
+{
+    if (1 == c) {
+	memcpy(dst[0], src, count * sz);
+	if (swab)
+	    swab_values(dst[0], count, sz);
+	return;
+    }
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    if (1 == sz)
+	i = split_any<1>(dst, src, count, c, false);
+    else if (2 == sz)
+	i = split_any<2>(dst, src, count, c, swab);
+#endif
+    switch (sz) {
+    case 1: deinterleave_t<GByte>(dst, src, i, count, c, false); break;
+    case 2: deinterleave_t<GUInt16>(dst, src, i, count, c, swab); break;
+    case 4: deinterleave_t<GUInt32>(dst, src, i, count, c, swab); break;
+    case 8: deinterleave_t<GUIntBig>(dst, src, i, count, c, swab); break;
+    default:
+	for (; i < count; i++)
+	    for (int b = 0; b < c; b++)
+		memcpy(dst[b] + i * sz, src + (i * c + b) * sz, sz);
+    }
+}
+
+/**
+ *\brief Merge separate bands in a pixel interleaved buffer, in a single pass
+ */
+void interleave(char *dst, char **src, size_t count, int c, int sz)
+{
+    if (1 == c) {
+	memcpy(dst, src[0], count * sz);
+	return;
+    }
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    if (1 == sz)
+	i = merge_any<1>(dst, src, count, c);
+    else if (2 == sz)
+	i = merge_any<2>(dst, src, count, c);
+#endif
+    switch (sz) {
+    case 1: interleave_t<GByte>(dst, src, i, count, c); break;
+    case 2: interleave_t<GInt16>(dst, src, i, count, c); break;
+    case 4: interleave_t<GInt32>(dst, src, i, count, c); break;
+    case 8: interleave_t<GIntBig>(dst, src, i, count, c); break;
+    default:
+	for (; i < count; i++)
+	    for (int b = 0; b < c; b++)
+		memcpy(dst + (i * c + b) * sz, src[b] + i * sz, sz);
+    }
+}
+
+/**
+ *\brief Swap the bytes of count values of sz bytes, in place
+ */
+void swab_values(char *b, size_t count, int sz)
+{
+    size_t i = 0;
+#if defined(MRF_USE_SSE2)
+    for (; i + 16 / sz <= count && sz <= 8; i += 16 / sz) {
+	__m128i *p = (__m128i *)(b + i * sz);
+	switch (sz) {
+	case 2: _mm_storeu_si128(p, vswab<2>(_mm_loadu_si128(p))); break;
+	case 4: _mm_storeu_si128(p, vswab<4>(_mm_loadu_si128(p))); break;
+	case 8: _mm_storeu_si128(p, vswab<8>(_mm_loadu_si128(p))); break;
+	}
+    }
+#endif
+    switch (sz) {
+    case 2: for (GUInt16 *p = (GUInt16 *)b; i < count; i++) p[i] = swab16(p[i]); break;
+    case 4: for (GUInt32 *p = (GUInt32 *)b; i < count; i++) p[i] = swab32(p[i]); break;
+    case 8: for (GUIntBig *p = (GUIntBig *)b; i < count; i++) p[i] = swab64(p[i]); break;
+    }
+}
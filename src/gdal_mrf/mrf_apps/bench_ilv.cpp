@@ -0,0 +1,99 @@
+/*
+ * Benchmark of the pixel interleave and deinterleave code
+ *
+ * Times the single pass deinterleave and interleave against the per band cpy_stride_in
+ * and cpy_stride_out loops they replaced, for Byte and Int16 with 2, 3 and 4 bands,
+ * and checks that the results are identical
+ *
+ * make bench_ilv
+ * ./bench_ilv [iterations]
+ * On an AVX2 CPU, run it again with MRF_NO_AVX2=YES in the environment to time the SSE2 code
+ */
+
+#include "marfa.h"
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using std::vector;
+
+static double Seconds(clock_t t) {
+    return double(clock() - t) / CLOCKS_PER_SEC;
+}
+
+template<typename T> static void Bench(const char *name, int tsz, int c, int iters) {
+    const size_t n = size_t(tsz) * tsz;
+    vector<T> src(n * c), ilv(n * c), ref(n * c);
+    vector<T> planes(n * c), refplanes(n * c);
+    vector<char *> p(c), rp(c);
+    for (int b = 0; b < c; b++) {
+	p[b] = (char *)&planes[b * n];
+	rp[b] = (char *)&refplanes[b * n];
+    }
+    srand(1234);
+    for (size_t i = 0; i < src.size(); i++)
+	src[i] = T(rand());
+
+    // Check
+    for (int b = 0; b < c; b++)
+	cpy_stride_in<T>(rp[b], &src[b], int(n), c);
+    deinterleave(&p[0], (char *)&src[0], n, c, sizeof(T));
+    int ok = (planes == refplanes);
+    for (int b = 0; b < c; b++)
+	cpy_stride_out<T>(&ref[b], rp[b], int(n), c);
+    interleave((char *)&ilv[0], &p[0], n, c, sizeof(T));
+    ok = ok && (ilv == ref) && (ref == src);
+
+    // Old and new write to the same buffers, the timing depends on their placement
+    double r[2], d[2];
+    clock_t t = clock();
+    for (int i = 0; i < iters; i++)
+	for (int b = 0; b < c; b++)
+	    cpy_stride_in<T>(p[b], &src[b], int(n), c);
+    r[0] = Seconds(t);
+    t = clock();
+    for (int i = 0; i < iters; i++)
+	deinterleave(&p[0], (char *)&src[0], n, c, sizeof(T));
+    d[0] = Seconds(t);
+    t = clock();
+    for (int i = 0; i < iters; i++)
+	for (int b = 0; b < c; b++)
+	    cpy_stride_out<T>(&ilv[b], p[b], int(n), c);
+    r[1] = Seconds(t);
+    t = clock();
+    for (int i = 0; i < iters; i++)
+	interleave((char *)&ilv[0], &p[0], n, c, sizeof(T));
+    d[1] = Seconds(t);
+
+    printf("%-6s %4d %2d  %8.3f %8.3f %6.2f  %8.3f %8.3f %6.2f  %s\n", name, tsz, c,
+	1000 * r[0] / iters, 1000 * d[0] / iters, r[0] / d[0],
+	1000 * r[1] / iters, 1000 * d[1] / iters, r[1] / d[1],
+	ok ? "same" : "DIFFERENT");
+}
+
+int main(int argc, char **argv)
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : 200;
+    if (iters < 1) iters = 1;
+
+    printf("%d iterations, %s code, ms per page\n", iters,
+#if defined(MRF_USE_AVX2)
+	CPUHasAVX2() ? "AVX2" :
+#endif
+#if defined(MRF_USE_SSE2)
+	"SSE2"
+#else
+	"scalar"
+#endif
+	);
+    printf("%-6s %4s %2s  %8s %8s %6s  %8s %8s %6s\n", "type", "size", "c",
+	"split old", "new", "x", "merge old", "new", "x");
+    for (int tsz = 256; tsz <= 512; tsz *= 2)
+	for (int c = 2; c <= 4; c++) {
+	    Bench<GByte>("Byte", tsz, c, iters);
+	    Bench<GInt16>("Int16", tsz, c, iters);
+	}
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Benchmark of the overview kernels, AverageByFour and MatchCount
+ *
+ * Times the driver kernels against the scalar code they replaced, on 2x2 blocks of
+ * 512x512 tiles, and checks that the results are identical.
+ * The kernels are declared in marfa.h and link from libgdal
+ *
+ * make bench_ovr
+ * ./bench_ovr [iterations]
+ * On an AVX2 CPU, run it again with MRF_NO_AVX2=YES in the environment to time the SSE2 code
+ */
+
+#include "marfa.h"
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using std::vector;
+
+#define TSZ 512
+
+// The scalar kernels, as they were before the SIMD versions
+template<typename T> static int RefMatchCount(T *buff, int sz, T val) {
+    int ncount=0;
+    for (int i=0; i < sz; i++)
+	if (buff[i] == val)
+	    ncount++;
+    return ncount;
+}
+
+template<typename T> static void RefAverageByFour(T *buff, int xsz, int ysz) {
+    T *obuff=buff;
+    T *evenline=buff;
+    for (int line=0; line<ysz; line++) {
+	T *oddline=evenline+xsz*2;
+	for (int col=0; col<xsz; col++) {
+	    *obuff++ = (T(2) + evenline[0] + evenline[1] + oddline[0] + oddline[1]) / 4;
+	    evenline +=2; oddline +=2;
+	}
+	evenline += xsz*2;
+    }
+}
+
+// Types which need a wider sum or don't round
+#define REF_WIDE(T, W, EXPR) \
+template<> void RefAverageByFour<T>(T *buff, int xsz, int ysz) { \
+    T *obuff=buff; \
+    T *evenline=buff; \
+    for (int line=0; line<ysz; line++) { \
+	T *oddline=evenline+xsz*2; \
+	for (int col=0; col<xsz; col++) { \
+	    W s = W(evenline[0]) + evenline[1] + oddline[0] + oddline[1]; \
+	    *obuff++ = T(EXPR); \
+	    evenline +=2; oddline +=2; \
+	} \
+	evenline += xsz*2; \
+    } \
+}
+
+REF_WIDE(GInt32, GIntBig, (s + 2) / 4)
+REF_WIDE(GUInt32, GIntBig, (s + 2) / 4)
+REF_WIDE(float, float, s * 0.25f)
+REF_WIDE(double, double, s * 0.25)
+#undef REF_WIDE
+
+template<typename T> static void RefAverageByFour(T *buff, int xsz, int ysz, T ndv) {
+    T *obuff=buff;
+    T *evenline=buff;
+    for (int line=0; line<ysz; line++) {
+	T *oddline=evenline+xsz*2;
+	for (int col=0; col<xsz; col++) {
+	    double acc = 0;
+	    GIntBig iacc = 0;
+	    int count = 0;
+#define use(valp) if (*valp != ndv) { acc += *valp; iacc += GIntBig(*valp); count++; }; valp++;
+	    use(evenline); use(evenline); use(oddline); use(oddline);
+#undef use
+	    if (T(0.5) != 0) // Floating point
+		*obuff++ = T((count != 0) ? acc / count : ndv);
+	    else
+		*obuff++ = T((count != 0) ? ((iacc + count/2) / count) : ndv);
+	}
+	evenline += xsz*2;
+    }
+}
+
+// Values over most of the type range, with about 10% NoData
+template<typename T> static void Fill(T *b, size_t n, T ndv) {
+    srand(1234);
+    for (size_t i = 0; i < n; i++) {
+	double r = double(rand()) / RAND_MAX;
+	if (r < 0.1)
+	    b[i] = ndv;
+	else if (T(0.5) != 0)
+	    b[i] = T(r * 10000.0 - 1000.0);
+	else if (T(-1) < 0)
+	    b[i] = T((r - 0.5) * 1.9 * double(T(~(GUIntBig(1) << (sizeof(T) * 8 - 1)))));
+	else
+	    b[i] = T(r * 0.99 * double(T(-1)));
+    }
+}
+
+static double Seconds(clock_t t) {
+    return double(clock() - t) / CLOCKS_PER_SEC;
+}
+
+// Times the four kernels on one type, the buffer copy time is subtracted
+template<typename T> static void Bench(const char *name, int iters) {
+    const size_t n = 4 * TSZ * TSZ;
+    T ndv = T(7);
+    vector<T> src(n), a(n), b(n);
+    Fill(&src[0], n, ndv);
+
+    // Check
+    a = src; b = src;
+    RefAverageByFour(&a[0], TSZ, TSZ);
+    AverageByFour(&b[0], TSZ, TSZ);
+    int ok = (0 == memcmp(&a[0], &b[0], TSZ * TSZ * sizeof(T)));
+    a = src; b = src;
+    RefAverageByFour(&a[0], TSZ, TSZ, ndv);
+    AverageByFour(&b[0], TSZ, TSZ, ndv);
+    ok = ok && (0 == memcmp(&a[0], &b[0], TSZ * TSZ * sizeof(T)));
+    ok = ok && (RefMatchCount(&src[0], int(n), ndv) == MatchCount(&src[0], int(n), ndv));
+
+    clock_t t = clock();
+    for (int i = 0; i < iters; i++)
+	memcpy(&a[0], &src[0], n * sizeof(T));
+    double copy = Seconds(t);
+
+    double r[4], d[4];
+    t = clock();
+    for (int i = 0; i < iters; i++) {
+	memcpy(&a[0], &src[0], n * sizeof(T));
+	RefAverageByFour(&a[0], TSZ, TSZ);
+    }
+    r[0] = Seconds(t) - copy;
+    t = clock();
+    for (int i = 0; i < iters; i++) {
+	memcpy(&a[0], &src[0], n * sizeof(T));
+	AverageByFour(&a[0], TSZ, TSZ);
+    }
+    d[0] = Seconds(t) - copy;
+    t = clock();
+    for (int i = 0; i < iters; i++) {
+	memcpy(&a[0], &src[0], n * sizeof(T));
+	RefAverageByFour(&a[0], TSZ, TSZ, ndv);
+    }
+    r[1] = Seconds(t) - copy;
+    t = clock();
+    for (int i = 0; i < iters; i++) {
+	memcpy(&a[0], &src[0], n * sizeof(T));
+	AverageByFour(&a[0], TSZ, TSZ, ndv);
+    }
+    d[1] = Seconds(t) - copy;
+
+    int sum = 0;
+    t = clock();
+    for (int i = 0; i < iters; i++)
+	sum += RefMatchCount(&src[0], int(n), T(ndv + i % 2));
+    r[2] = Seconds(t);
+    t = clock();
+    for (int i = 0; i < iters; i++)
+	sum -= MatchCount(&src[0], int(n), T(ndv + i % 2));
+    d[2] = Seconds(t);
+
+    printf("%-8s %8.3f %8.3f %6.2f  %8.3f %8.3f %6.2f  %8.3f %8.3f %6.2f  %s\n", name,
+	1000 * r[0] / iters, 1000 * d[0] / iters, r[0] / d[0],
+	1000 * r[1] / iters, 1000 * d[1] / iters, r[1] / d[1],
+	1000 * r[2] / iters, 1000 * d[2] / iters, r[2] / d[2],
+	(ok && 0 == sum) ? "same" : "DIFFERENT");
+}
+
+int main(int argc, char **argv)
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : 200;
+    if (iters < 1) iters = 1;
+
+    printf("%d iterations, %dx%d output tiles, %s code, ms per tile\n", iters, TSZ, TSZ,
+#if defined(MRF_USE_AVX2)
+	CPUHasAVX2() ? "AVX2" :
+#endif
+#if defined(MRF_USE_SSE2)
+	"SSE2"
+#else
+	"scalar"
+#endif
+	);
+    printf("%-8s %8s %8s %6s  %8s %8s %6s  %8s %8s %6s\n", "type",
+	"avg old", "new", "x", "ndv old", "new", "x", "count old", "new", "x");
+    Bench<GByte>("Byte", iters);
+    Bench<GUInt16>("UInt16", iters);
+    Bench<GInt16>("Int16", iters);
+    Bench<GUInt32>("UInt32", iters);
+    Bench<GInt32>("Int32", iters);
+    Bench<float>("Float32", iters);
+    Bench<double>("Float64", iters);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Benchmark of the PNG_PROFILE encoder settings
+ *
+ * Copies a 512x512 page into a PNG MRF with each profile and the library defaults,
+ * reports the data file size and the time taken to write and to read it back, and
+ * checks the round trip.  It goes through the driver and the PNG library linked into
+ * libgdal, so build GDAL with the bundled libpng to measure that one.
+ *
+ * make bench_png
+ * ./bench_png [iterations] [image]
+ * With an image, the top left page of its first three bands is used, otherwise a synthetic
+ * graphics page and a synthetic photo like page
+ */
+
+#include "gdal_priv.h"
+#include "cpl_string.h"
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+using std::vector;
+
+#define TSZ 512
+#define BANDS 3
+
+static const char *profiles[] = { NULL, "FAST", "BALANCED", "SMALL" };
+
+static double Seconds(clock_t t) {
+    return double(clock() - t) / CLOCKS_PER_SEC;
+}
+
+// Flat areas, lines and a bit of text like noise, band interleaved
+static void FillGraphics(GByte *b) {
+    srand(1234);
+    for (int y = 0; y < TSZ; y++)
+	for (int x = 0; x < TSZ; x++) {
+	    GByte *p = b + (y * TSZ + x) * BANDS;
+	    int cell = (x / 64) ^ (y / 48);
+	    p[0] = GByte(40 * (cell % 6));
+	    p[1] = GByte(200 - 30 * (cell % 5));
+	    p[2] = GByte(90 + 20 * (cell % 7));
+	    if (0 == x % 37 || 0 == y % 53 || (x - y) % 97 == 0)
+		p[0] = p[1] = p[2] = 0;
+	    if ((y / 8) % 6 == 1 && (x / 6) % 3 != 0 && rand() % 3 == 0)
+		p[0] = p[1] = p[2] = 255;
+	}
+}
+
+// Smooth color gradients with sensor like noise
+static void FillPhoto(GByte *b) {
+    srand(1234);
+    for (int y = 0; y < TSZ; y++)
+	for (int x = 0; x < TSZ; x++) {
+	    GByte *p = b + (y * TSZ + x) * BANDS;
+	    for (int c = 0; c < BANDS; c++) {
+		double v = 128 + 90 * sin((x + 40 * c) / 70.0) * cos(y / (50.0 + 10 * c))
+		    + 8.0 * rand() / RAND_MAX;
+		p[c] = GByte(MAX(0.0, MIN(255.0, v)));
+	    }
+	}
+}
+
+static bool ReadPage(const char *fname, GByte *b) {
+    GDALDataset *ds = (GDALDataset *)GDALOpen(fname, GA_ReadOnly);
+    if (NULL == ds)
+	return false;
+    int c = MIN(BANDS, ds->GetRasterCount());
+    bool ok = (ds->GetRasterXSize() >= TSZ && ds->GetRasterYSize() >= TSZ)
+	&& CE_None == ds->RasterIO(GF_Read, 0, 0, TSZ, TSZ, b, TSZ, TSZ, GDT_Byte,
+	    c, NULL, BANDS, BANDS * TSZ, 1);
+    // Replicate the last band when there are fewer than three
+    for (int i = 0; ok && i < TSZ * TSZ; i++)
+	for (int k = c; k < BANDS; k++)
+	    b[i * BANDS + k] = b[i * BANDS + c - 1];
+    GDALClose(ds);
+    return ok;
+}
+
+static void Bench(const char *name, vector<GByte> &src, int iters) {
+    GDALDriver *mem = GetGDALDriverManager()->GetDriverByName("MEM");
+    GDALDriver *mrf = GetGDALDriverManager()->GetDriverByName("MRF");
+    const char *fname = "/vsimem/bench_png.mrf";
+    const char *dname = "/vsimem/bench_png.ppg";
+
+    GDALDataset *srcds = mem->Create("", TSZ, TSZ, BANDS, GDT_Byte, NULL);
+    srcds->RasterIO(GF_Write, 0, 0, TSZ, TSZ, &src[0], TSZ, TSZ, GDT_Byte,
+	BANDS, NULL, BANDS, BANDS * TSZ, 1);
+
+    vector<GByte> back(src.size());
+    for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+	char **opts = NULL;
+	opts = CSLSetNameValue(opts, "COMPRESS", "PNG");
+	opts = CSLSetNameValue(opts, "BLOCKSIZE", CPLString().Printf("%d", TSZ));
+	opts = CSLSetNameValue(opts, "INTERLEAVE", "PIXEL");
+	if (profiles[p])
+	    opts = CSLSetNameValue(opts, "OPTIONS",
+		CPLString().Printf("PNG_PROFILE=%s", profiles[p]));
+
+	// Each copy makes a new file, so the size is that of a single page
+	bool ok = true;
+	clock_t t = clock();
+	for (int i = 0; ok && i < iters; i++) {
+	    GDALDataset *ds = mrf->CreateCopy(fname, srcds, FALSE, opts, NULL, NULL);
+	    ok = (NULL != ds);
+	    GDALClose(ds);
+	}
+	double enc = Seconds(t);
+	CSLDestroy(opts);
+
+	VSIStatBufL stat;
+	long size = (ok && 0 == VSIStatL(dname, &stat)) ? long(stat.st_size) : 0;
+
+	t = clock();
+	for (int i = 0; ok && i < iters; i++)
+	    ok = ReadPage(fname, &back[0]);
+	double dec = Seconds(t);
+	ok = ok && (back == src);
+
+	mrf->Delete(fname);
+	printf("%-8s %-8s %8ld %6.2f %8.3f %8.3f  %s\n", name,
+	    profiles[p] ? profiles[p] : "default", size, size ? double(src.size()) / size : 0.0,
+	    1000 * enc / iters, 1000 * dec / iters, ok ? "same" : "DIFFERENT");
+    }
+    GDALClose(srcds);
+}
+
+int main(int argc, char **argv)
+{
+    GDALAllRegister();
+    int iters = (argc > 1) ? atoi(argv[1]) : 20;
+    if (iters < 1) iters = 1;
+
+    if (NULL == GetGDALDriverManager()->GetDriverByName("MRF")) {
+	fprintf(stderr, "The MRF driver is not available\n");
+	return 1;
+    }
+
+    printf("%d iterations, %dx%dx%d pages, %s, ms per page\n",
+	iters, TSZ, TSZ, BANDS, GDALVersionInfo("--version"));
+    printf("%-8s %-8s %8s %6s %8s %8s\n", "page", "profile", "bytes", "ratio",
+	"write", "read");
+
+    vector<GByte> page(size_t(TSZ) * TSZ * BANDS);
+    if (argc > 2) {
+	if (!ReadPage(argv[2], &page[0])) {
+	    fprintf(stderr, "Can't read a %dx%d page from %s\n", TSZ, TSZ, argv[2]);
+	    return 1;
+	}
+	Bench("image", page, iters);
+    }
+    else {
+	FillGraphics(&page[0]);
+	Bench("graphics", page, iters);
+	FillPhoto(&page[0]);
+	Bench("photo", page, iters);
+    }
+    GDALDestroyDriverManager();
+    return 0;
+}
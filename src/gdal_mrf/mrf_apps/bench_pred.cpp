@@ -0,0 +1,131 @@
+/*
+ * Benchmark of the raw page predictors, SHUFFLE and DELTA, ahead of zlib
+ *
+ * For a synthetic 512x512 elevation like page of each type, reports the deflated size
+ * and the time taken by the predictor and by zlib, both ways, and checks the round trip.
+ * The predictors are declared in marfa.h and link from libgdal
+ *
+ * make bench_pred
+ * ./bench_pred [iterations] [zlib level]
+ * Build the driver with -DMRF_NO_SSE2 to time the scalar predictors
+ */
+
+#include "marfa.h"
+#include <zlib.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+
+using std::vector;
+
+#define TSZ 512
+
+// Smooth surface with a bit of noise
+template<typename T> static void Fill(T *b, double offset) {
+    srand(1234);
+    for (int y = 0; y < TSZ; y++)
+	for (int x = 0; x < TSZ; x++) {
+	    double v = offset + 500 * sin(x / 40.0) * cos(y / 55.0) + 0.02 * x * y
+		+ 6.0 * rand() / RAND_MAX;
+	    b[y * TSZ + x] = T(v);
+	}
+}
+
+static double Seconds(clock_t t) {
+    return double(clock() - t) / CLOCKS_PER_SEC;
+}
+
+enum { P_NONE, P_SHUFFLE, P_DELTA };
+static const char *pnames[] = { "NONE", "SHUFFLE", "DELTA" };
+
+template<typename T> static void Bench(const char *name, GDALDataType dt, double offset,
+    int iters, int level)
+{
+    ILImage img;
+    img.dt = dt;
+    img.pagesize = ILSize(TSZ, TSZ, 1, 1);
+    size_t psb = size_t(TSZ) * TSZ * sizeof(T);
+
+    vector<T> src(TSZ * TSZ);
+    Fill(&src[0], offset);
+    vector<char> pred(psb), back(psb), out(compressBound(uLong(psb)));
+
+    for (int p = P_NONE; p <= P_DELTA; p++) {
+	buf_mgr s = {(char *)&src[0], psb};
+	buf_mgr d = {&pred[0], psb};
+
+	// Forward predictor
+	clock_t t = clock();
+	for (int i = 0; i < iters; i++) {
+	    if (P_DELTA == p)
+		delta_buff(d, s, img);
+	    else if (P_SHUFFLE == p)
+		shuffle(d.buffer, s.buffer, TSZ * TSZ, sizeof(T));
+	    else
+		memcpy(d.buffer, s.buffer, psb);
+	}
+	double penc = Seconds(t);
+
+	uLongf osz = 0;
+	t = clock();
+	for (int i = 0; i < iters; i++) {
+	    osz = uLongf(out.size());
+	    compress2((Bytef *)&out[0], &osz, (Bytef *)d.buffer, uLong(psb), level);
+	}
+	double zenc = Seconds(t);
+
+	uLongf bsz = 0;
+	t = clock();
+	for (int i = 0; i < iters; i++) {
+	    bsz = uLongf(psb);
+	    uncompress((Bytef *)&back[0], &bsz, (Bytef *)&out[0], osz);
+	}
+	double zdec = Seconds(t);
+
+	// Inverse predictor, the delta works in place so it gets a fresh copy each time
+	buf_mgr b = {&back[0], psb};
+	t = clock();
+	for (int i = 0; i < iters; i++) {
+	    if (P_DELTA == p) {
+		memcpy(b.buffer, d.buffer, psb);
+		undelta_buff(b, img);
+	    }
+	    else if (P_SHUFFLE == p)
+		unshuffle(b.buffer, d.buffer, TSZ * TSZ, sizeof(T));
+	    else
+		memcpy(b.buffer, d.buffer, psb);
+	}
+	double pdec = Seconds(t);
+
+	int ok = (bsz == psb) && (0 == memcmp(b.buffer, &src[0], psb));
+	printf("%-8s %-8s %8ld %6.2f %8.3f %8.3f %8.3f %8.3f  %s\n", name, pnames[p],
+	    long(osz), double(psb) / osz,
+	    1000 * penc / iters, 1000 * zenc / iters, 1000 * zdec / iters, 1000 * pdec / iters,
+	    ok ? "same" : "DIFFERENT");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : 20;
+    int level = (argc > 2) ? atoi(argv[2]) : 6;
+    if (iters < 1) iters = 1;
+
+    printf("%d iterations, %dx%d pages, zlib level %d, %s predictors, ms per page\n",
+	iters, TSZ, TSZ, level,
+#if defined(MRF_USE_SSE2)
+	"SSE2"
+#else
+	"scalar"
+#endif
+	);
+    printf("%-8s %-8s %8s %6s %8s %8s %8s %8s\n", "type", "pred", "bytes", "ratio",
+	"pred", "deflate", "inflate", "unpred");
+    Bench<GUInt16>("UInt16", GDT_UInt16, 1000, iters, level);
+    Bench<GInt16>("Int16", GDT_Int16, -200, iters, level);
+    Bench<float>("Float32", GDT_Float32, 1000, iters, level);
+    return 0;
+}
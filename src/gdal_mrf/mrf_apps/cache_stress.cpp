@@ -0,0 +1,250 @@
+/*
+ * Stress test of the caching MRF, many processes and datasets filling the same cache
+ *
+ * The parent writes a source MRF with a known pattern and creates an empty caching MRF
+ * of it, with or without CACHE_LOCK.  Each of N processes then runs T threads, every
+ * thread opens its own dataset on the cache and reads all the tiles, in its own order.
+ * The tiles get fetched from the source and appended to the one data file by all of
+ * them at once.  Every read is checked against the pattern.  At the end the parent moves
+ * the source away and checks the whole cache again, so every tile comes from the cache.
+ *
+ * Modes:
+ *  lock     CACHE_LOCK=YES, the appends are serialized by the data file lock
+ *  verify   no lock, each tile is read back and written again if it got clobbered
+ *
+ * make cache_stress
+ * ./cache_stress lock|verify [processes] [threads per process] [tiles per side]
+ * Writes the stress_src and stress MRFs in the current folder, returns 1 if any tile is bad
+ */
+
+#include "gdal_priv.h"
+#include "cpl_string.h"
+#include "cpl_multiproc.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#if defined(WIN32)
+
+int main()
+{
+    fprintf(stderr, "cache_stress needs fork, not available on Windows\n");
+    return 1;
+}
+
+#else
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+using std::vector;
+
+#define SRCNAME "stress_src.mrf"
+#define SRCMOVED "stress_src.mrf.moved"
+#define CACHENAME "stress.mrf"
+#define DATNAME "stress.pzp"
+#define TSZ 256
+
+enum { M_LOCK, M_VERIFY };
+static const char *mnames[] = { "lock", "verify" };
+
+static unsigned Hash(unsigned x, unsigned y) {
+    unsigned h = x * 73856093u ^ y * 19349663u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    return h ^ (h >> 15);
+}
+
+// A gradient with a different amount of noise in each tile, so the tile sizes vary
+static GByte Pixel(int x, int y) {
+    int bits = Hash(x / TSZ, y / TSZ) % 8;
+    return GByte(((x + 2 * y) & 0xff) ^ (Hash(x, y) & ((1 << bits) - 1)));
+}
+
+// Reads tile tx, ty and compares it with the pattern, returns true if it matches
+static bool CheckTile(GDALDataset *ds, int tx, int ty, GByte *b) {
+    if (CE_None != ds->RasterIO(GF_Read, tx * TSZ, ty * TSZ, TSZ, TSZ, b, TSZ, TSZ,
+	GDT_Byte, 1, NULL, 0, 0, 0))
+	return false;
+    for (int y = 0; y < TSZ; y++)
+	for (int x = 0; x < TSZ; x++)
+	    if (b[y * TSZ + x] != Pixel(tx * TSZ + x, ty * TSZ + y))
+		return false;
+    return true;
+}
+
+struct Reader {
+    int seed;
+    int ntiles;		// Per side
+    int bad;
+};
+
+// One thread, with its own dataset on the cache, reads all the tiles in a random order
+static void ReaderThread(void *arg) {
+    Reader *r = static_cast<Reader *>(arg);
+    int n = r->ntiles * r->ntiles;
+    r->bad = n;
+    GDALDataset *ds = (GDALDataset *)GDALOpen(CACHENAME, GA_ReadOnly);
+    if (NULL == ds)
+	return;
+
+    vector<int> order(n);
+    for (int i = 0; i < n; i++)
+	order[i] = i;
+    unsigned s = unsigned(r->seed);
+    for (int i = n - 1; i > 0; i--) {
+	s = s * 1103515245u + 12345u;
+	int j = int((s >> 8) % unsigned(i + 1));
+	int t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+
+    vector<GByte> b(TSZ * TSZ);
+    r->bad = 0;
+    for (int i = 0; i < n; i++)
+	if (!CheckTile(ds, order[i] % r->ntiles, order[i] / r->ntiles, &b[0]))
+	    r->bad++;
+    GDALClose(ds);
+}
+
+// One process, returns the number of bad reads
+static int Process(int p, int nthreads, int ntiles) {
+    vector<Reader> r(nthreads);
+    vector<CPLJoinableThread *> threads;
+    for (int i = 0; i < nthreads; i++) {
+	Reader rd = { p * 1000 + i, ntiles, 0 };
+	r[i] = rd;
+    }
+    for (int i = 1; i < nthreads; i++)
+	threads.push_back(CPLCreateJoinableThread(ReaderThread, &r[i]));
+    ReaderThread(&r[0]);
+    int bad = 0;
+    for (int i = 1; i < nthreads; i++) {
+	if (threads[i - 1])
+	    CPLJoinThread(threads[i - 1]);
+	else
+	    r[i].bad = ntiles * ntiles;
+    }
+    for (int i = 0; i < nthreads; i++)
+	bad += r[i].bad;
+    return bad;
+}
+
+// The source and the empty cache
+static bool Setup(int mode, int ntiles) {
+    GDALDriver *mrf = GetGDALDriverManager()->GetDriverByName("MRF");
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    mrf->Delete(CACHENAME);
+    mrf->Delete(SRCNAME);
+    VSIUnlink(SRCMOVED);
+    CPLPopErrorHandler();
+
+    int sz = ntiles * TSZ;
+    char **opts = NULL;
+    opts = CSLSetNameValue(opts, "COMPRESS", "NONE");
+    opts = CSLSetNameValue(opts, "BLOCKSIZE", CPLString().Printf("%d", TSZ));
+    GDALDataset *src = mrf->Create(SRCNAME, sz, sz, 1, GDT_Byte, opts);
+    CSLDestroy(opts);
+    if (NULL == src)
+	return false;
+    vector<GByte> line(sz);
+    CPLErr err = CE_None;
+    for (int y = 0; CE_None == err && y < sz; y++) {
+	for (int x = 0; x < sz; x++)
+	    line[x] = Pixel(x, y);
+	err = src->RasterIO(GF_Write, 0, y, sz, 1, &line[0], sz, 1, GDT_Byte, 1, NULL, 0, 0, 0);
+    }
+    GDALClose(src);
+    if (CE_None != err || NULL == (src = (GDALDataset *)GDALOpen(SRCNAME, GA_ReadOnly)))
+	return false;
+
+    opts = NULL;
+    opts = CSLSetNameValue(opts, "COMPRESS", "DEFLATE");
+    opts = CSLSetNameValue(opts, "BLOCKSIZE", CPLString().Printf("%d", TSZ));
+    opts = CSLSetNameValue(opts, "CACHEDSOURCE", SRCNAME);
+    opts = CSLSetNameValue(opts, "NOCOPY", "YES");
+    if (M_LOCK == mode)
+	opts = CSLSetNameValue(opts, "OPTIONS", "CACHE_LOCK=YES");
+    GDALDataset *ds = mrf->CreateCopy(CACHENAME, src, FALSE, opts, NULL, NULL);
+    CSLDestroy(opts);
+    GDALClose(src);
+    if (NULL == ds)
+	return false;
+    GDALClose(ds);
+    return true;
+}
+
+// With the source out of the way, every tile has to come from the cache
+static int CheckCache(int ntiles) {
+    if (0 != VSIRename(SRCNAME, SRCMOVED))
+	return ntiles * ntiles;
+    GDALDataset *ds = (GDALDataset *)GDALOpen(CACHENAME, GA_ReadOnly);
+    if (NULL == ds)
+	return ntiles * ntiles;
+    vector<GByte> b(TSZ * TSZ);
+    int bad = 0;
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    for (int ty = 0; ty < ntiles; ty++)
+	for (int tx = 0; tx < ntiles; tx++)
+	    if (!CheckTile(ds, tx, ty, &b[0]))
+		bad++;
+    CPLPopErrorHandler();
+    GDALClose(ds);
+    VSIRename(SRCMOVED, SRCNAME);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    int mode = -1;
+    for (int m = M_LOCK; argc > 1 && m <= M_VERIFY; m++)
+	if (EQUAL(argv[1], mnames[m]))
+	    mode = m;
+    if (mode < 0) {
+	fprintf(stderr, "Usage: %s lock|verify [processes] [threads per process] [tiles per side]\n",
+	    argv[0]);
+	return 1;
+    }
+    int nproc = (argc > 2) ? atoi(argv[2]) : 8;
+    int nthreads = (argc > 3) ? atoi(argv[3]) : 4;
+    int ntiles = (argc > 4) ? atoi(argv[4]) : 32;
+    if (nproc < 1 || nthreads < 1 || ntiles < 1) {
+	fprintf(stderr, "Need at least one process, one thread and one tile\n");
+	return 1;
+    }
+
+    GDALAllRegister();
+    if (NULL == GetGDALDriverManager()->GetDriverByName("MRF")) {
+	fprintf(stderr, "The MRF driver is not available\n");
+	return 1;
+    }
+    if (!Setup(mode, ntiles)) {
+	fprintf(stderr, "Can't create the %s and %s files\n", SRCNAME, CACHENAME);
+	return 1;
+    }
+
+    // No datasets or threads are open here, the children start clean
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int p = 0; p < nproc; p++)
+	if (0 == fork())
+	    _exit(Process(p, nthreads, ntiles) ? 1 : 0);
+    int failed = 0, status;
+    while (wait(&status) > 0)
+	if (!WIFEXITED(status) || 0 != WEXITSTATUS(status))
+	    failed++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int bad = CheckCache(ntiles);
+    VSIStatBufL stat;
+    GIntBig fsize = (0 == VSIStatL(DATNAME, &stat)) ? GIntBig(stat.st_size) : 0;
+    printf("%d processes, %d threads each, %d tiles, %s: %.2fs, %d processes with bad reads, "
+	"%d bad tiles in the cache, %d MB data file\n",
+	nproc, nthreads, ntiles * ntiles, mnames[mode],
+	(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9,
+	failed, bad, int(fsize >> 20));
+    GDALDestroyDriverManager();
+    return (failed || bad) ? 1 : 0;
+}
+
+#endif